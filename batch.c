@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glob.h>
+#include <glib.h>
+
+#include "structs.h"
+#include "parser.h"
+#include "exec.h"
+#include "batch.h"
+
+// Execução em lote: cada thread pega a próxima escala da lista, lê e executa
+// com o seu próprio gerenciador de locks (o estado de exec.c é por thread) e
+// guarda só o relatório. O rastro de cada escala é descartado.
+
+struct batch_file
+{
+	char *name;
+	int parsed;
+	struct exec_stats run;
+	// Leitura mais execução, em segundos.
+	double elapsed;
+};
+
+static struct batch_file *files;
+static int nfiles;
+static int next_file;
+
+static int name_cmp(gconstpointer a, gconstpointer b) {
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+// Arquivos comuns do diretório path, ou os que casam com o glob path, em
+// ordem de nome.
+static GPtrArray *list_files(char *path) {
+	GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+
+	if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+		GDir *dir = g_dir_open(path, 0, NULL);
+		const char *entry;
+
+		while ((dir != NULL) && ((entry = g_dir_read_name(dir)) != NULL)) {
+			char *name = g_build_filename(path, entry, NULL);
+			if (g_file_test(name, G_FILE_TEST_IS_REGULAR))
+				g_ptr_array_add(names, name);
+			else
+				g_free(name);
+		}
+		if (dir != NULL)
+			g_dir_close(dir);
+	}
+	else {
+		glob_t matches;
+
+		if (glob(path, 0, NULL, &matches) == 0) {
+			for (size_t i = 0; i < matches.gl_pathc; i++) {
+				if (g_file_test(matches.gl_pathv[i], G_FILE_TEST_IS_REGULAR))
+					g_ptr_array_add(names, g_strdup(matches.gl_pathv[i]));
+			}
+		}
+		globfree(&matches);
+	}
+
+	g_ptr_array_sort(names, name_cmp);
+
+	return names;
+}
+
+static gpointer batch_worker(gpointer data) {
+	struct batch_file *file;
+	GSList *op_list;
+	GTimer *timer;
+	FILE *null;
+	int i;
+
+	null = fopen("/dev/null", "w");
+	exec_set_output(null);
+	timer = g_timer_new();
+
+	while ((i = g_atomic_int_add(&next_file, 1)) < nfiles) {
+		file = &files[i];
+		g_timer_start(timer);
+		op_list = parse_operations(file->name);
+		file->parsed = (op_list != NULL);
+		exec_operations(op_list, &file->run);
+		operations_cleanup(op_list);
+		file->elapsed = g_timer_elapsed(timer, NULL);
+	}
+
+	g_timer_destroy(timer);
+	exec_set_output(NULL);
+	if (null != NULL)
+		fclose(null);
+
+	return NULL;
+}
+
+int exec_batch(char *pattern, int nworkers) {
+	GPtrArray *names;
+	GThread **threads;
+	GTimer *timer;
+	struct exec_stats total;
+	double busy = 0;
+	int dirty = 0;
+	int i;
+
+	names = list_files(pattern);
+	nfiles = names->len;
+	if (nfiles == 0) {
+		printf("No schedules found in \"%s\".\n", pattern);
+		g_ptr_array_free(names, TRUE);
+		return 1;
+	}
+
+	nworkers = MIN(nworkers, nfiles);
+	printf("Running %d schedules on %d threads\n", nfiles, nworkers);
+
+	files = g_new0(struct batch_file, nfiles);
+	for (i = 0; i < nfiles; i++)
+		files[i].name = g_ptr_array_index(names, i);
+
+	// Sem rastro: ninguém vai ler, e ele custa tempo.
+	verbose = 0;
+	timer = g_timer_new();
+	next_file = 0;
+	threads = g_new(GThread *, nworkers);
+	for (i = 0; i < nworkers; i++)
+		threads[i] = g_thread_new("batch", batch_worker, NULL);
+	for (i = 0; i < nworkers; i++)
+		g_thread_join(threads[i]);
+	g_timer_stop(timer);
+
+	memset(&total, 0, sizeof(struct exec_stats));
+	printf("%-32s %9s %9s %9s %9s %9s %7s %7s %7s %7s %10s\n", "schedule", "ops",
+			"trans", "committed", "deadlocks", "aborts", "S left", "U left",
+			"X left", "waiting", "time (ms)");
+	for (i = 0; i < nfiles; i++) {
+		struct exec_stats *run = &files[i].run;
+		int left = run->locks_s_left + run->locks_u_left + run->locks_x_left +
+			run->waits_left;
+
+		if (!files[i].parsed) {
+			printf("%-32s %9s\n", files[i].name, "no operations");
+			continue;
+		}
+
+		printf("%-32s %9d %9d %9d %9d %9d %7d %7d %7d %7d %10.3f%s\n", files[i].name,
+				run->operations, run->transactions, run->committed, run->deadlocks,
+				run->aborts, run->locks_s_left, run->locks_u_left, run->locks_x_left,
+				run->waits_left, 1000 * files[i].elapsed, left ? "  ERROR!" : "");
+
+		dirty += (left > 0);
+		busy += files[i].elapsed;
+		total.operations += run->operations;
+		total.transactions += run->transactions;
+		total.committed += run->committed;
+		total.deadlocks += run->deadlocks;
+		total.aborts += run->aborts;
+	}
+
+	printf("Total: %d operations, %d transactions (%d committed), %d deadlocks, "
+			"%d aborts\n", total.operations, total.transactions, total.committed,
+			total.deadlocks, total.aborts);
+	printf("Wall time %.3fs for %.3fs of work; %d of %d schedules left locks behind\n",
+			g_timer_elapsed(timer, NULL), busy, dirty, nfiles);
+
+	g_timer_destroy(timer);
+	g_free(threads);
+	g_free(files);
+	g_ptr_array_free(names, TRUE);
+
+	return dirty > 0;
+}
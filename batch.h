@@ -0,0 +1,13 @@
+#ifndef _BATCH_
+#define _BATCH_
+
+#include <glib.h>
+
+#include "structs.h"
+
+// Executa as escalas de um diretório ou de um padrão glob em nworkers
+// threads e imprime uma tabela com o resultado de cada uma. Retorna 1 se
+// alguma escala terminou com locks ou esperas sobrando.
+int exec_batch(char *pattern, int nworkers);
+
+#endif
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "holders.h"
+
+// Microbenchmark dos donos de lock: as listas de ponteiros para o id da
+// transação, como as tabelas de lock eram, contra os holder_set. As
+// varreduras de lista custam O(n²) com g_slist_nth_data, então repetem
+// menos vezes que as operações do bitset.
+
+#define ROUNDS_OPS 20000000
+#define SET_ROUNDS 5000000
+#define VARS 64
+
+static volatile int sink;
+
+// Como o can_x_lock varria a lista: g_slist_nth_data a cada posição.
+static int list_has_other(GSList *t, int transaction) {
+	for (int i = 0; i < g_slist_length(t); i++) {
+		int *id = g_slist_nth_data(t, i);
+		if (*id != transaction)
+			return 1;
+	}
+
+	return 0;
+}
+
+// Como o can_read/can_write procuravam a própria transação.
+static int list_contains(GSList *t, int transaction) {
+	for (int i = 0; i < g_slist_length(t); i++) {
+		int *id = g_slist_nth_data(t, i);
+		if (*id == transaction)
+			return 1;
+	}
+
+	return 0;
+}
+
+static GSList *list_remove(GSList *t, int transaction) {
+	for (GSList *l = t; l != NULL; l = l->next) {
+		if (*(int *)l->data == transaction)
+			return g_slist_delete_link(t, l);
+	}
+
+	return t;
+}
+
+static double per_op(GTimer *timer, long ops) {
+	return g_timer_elapsed(timer, NULL) * 1e9 / ops;
+}
+
+static void bench(int holders) {
+	int *ids = g_new(int, holders);
+	GSList *lists[VARS] = { NULL };
+	struct holder_set *sets[VARS];
+	GTimer *timer = g_timer_new();
+	long rounds = MAX(ROUNDS_OPS / ((long)holders * holders), 4);
+	long set_rounds = SET_ROUNDS;
+	double list_ns, set_ns;
+	int self = holders - 1;
+
+	// A transação self é a última a ter entrado em cada lista.
+	for (int i = 0; i < holders; i++)
+		ids[i] = i;
+	for (int v = 0; v < VARS; v++) {
+		sets[v] = holder_set_new();
+		for (int i = 0; i < holders; i++) {
+			lists[v] = g_slist_prepend(lists[v], &ids[i]);
+			holder_set_add(sets[v], i);
+		}
+	}
+
+	printf("%8d", holders);
+
+	// Conflito de X_LOCK pedido pelo dono mais novo.
+	g_timer_start(timer);
+	for (long r = 0; r < rounds; r++)
+		sink += list_has_other(lists[r % VARS], ids[self]);
+	list_ns = per_op(timer, rounds);
+	g_timer_start(timer);
+	for (long r = 0; r < set_rounds; r++)
+		sink += holder_set_has_other(sets[r % VARS], self);
+	set_ns = per_op(timer, set_rounds);
+	printf(" %12.1f %12.1f", list_ns, set_ns);
+
+	// Pertinência do dono mais antigo, no fim da lista.
+	g_timer_start(timer);
+	for (long r = 0; r < rounds; r++)
+		sink += list_contains(lists[r % VARS], 0);
+	list_ns = per_op(timer, rounds);
+	g_timer_start(timer);
+	for (long r = 0; r < set_rounds; r++)
+		sink += holder_set_contains(sets[r % VARS], 0);
+	set_ns = per_op(timer, set_rounds);
+	printf(" %12.1f %12.1f", list_ns, set_ns);
+
+	// Abort: cada transação solta os locks que tem em todas as variáveis.
+	g_timer_start(timer);
+	for (int i = 0; i < holders; i++)
+		for (int v = 0; v < VARS; v++)
+			lists[v] = list_remove(lists[v], i);
+	list_ns = per_op(timer, (long)holders * VARS);
+	g_timer_start(timer);
+	for (int i = 0; i < holders; i++)
+		for (int v = 0; v < VARS; v++)
+			sink += holder_set_remove(sets[v], i);
+	set_ns = per_op(timer, (long)holders * VARS);
+	printf(" %12.1f %12.1f\n", list_ns, set_ns);
+
+	for (int v = 0; v < VARS; v++) {
+		g_slist_free(lists[v]);
+		holder_set_free(sets[v]);
+	}
+	g_timer_destroy(timer);
+	g_free(ids);
+}
+
+int main(int argc, char **argv) {
+	int sizes[] = { 1, 4, 16, 64, 256, 1024, 4096 };
+
+	printf("ns per operation, list scan vs holder_set\n");
+	printf("%8s %12s %12s %12s %12s %12s %12s\n", "holders",
+			"x-check", "(bitset)", "member", "(bitset)", "release", "(bitset)");
+	for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		bench(sizes[i]);
+
+	return 0;
+}
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "checkpoint.h"
+
+// Cabeçalho: a assinatura com o terminador, um byte de versão e o CRC-32
+// do resto do arquivo, little-endian.
+#define CRC_OFFSET (sizeof(CHECKPOINT_MAGIC) + 1)
+#define HEADER_SIZE (CRC_OFFSET + 4)
+
+// CRC-32 do zlib (polinômio refletido 0xEDB88320).
+static guint32 crc32(const guint8 *data, gsize size) {
+	static guint32 table[256];
+	guint32 crc = 0xffffffff;
+
+	if (table[1] == 0) {
+		for (guint32 i = 0; i < 256; i++) {
+			guint32 c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+			table[i] = c;
+		}
+	}
+
+	for (gsize i = 0; i < size; i++)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+	return crc ^ 0xffffffff;
+}
+
+GByteArray *checkpoint_new(void) {
+	GByteArray *buf = g_byte_array_new();
+	guint8 version = CHECKPOINT_VERSION;
+	guint8 crc[4] = { 0, 0, 0, 0 };
+
+	g_byte_array_append(buf, (guint8 *)CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+	g_byte_array_append(buf, &version, 1);
+	g_byte_array_append(buf, crc, 4);
+
+	return buf;
+}
+
+// Zigzag leva os negativos pequenos (o -1 de "nenhum") para poucos bytes;
+// cada byte carrega 7 bits, com o bit alto marcando que há mais.
+void checkpoint_put(GByteArray *buf, gint64 value) {
+	guint64 v = ((guint64)value << 1) ^ (guint64)(value >> 63);
+	guint8 byte;
+
+	while (v >= 0x80) {
+		byte = (v & 0x7f) | 0x80;
+		g_byte_array_append(buf, &byte, 1);
+		v >>= 7;
+	}
+	byte = v;
+	g_byte_array_append(buf, &byte, 1);
+}
+
+int checkpoint_write(char *path, GByteArray *buf) {
+	GError *error = NULL;
+	guint32 crc;
+
+	crc = crc32(buf->data + HEADER_SIZE, buf->len - HEADER_SIZE);
+	for (int i = 0; i < 4; i++)
+		buf->data[CRC_OFFSET + i] = (crc >> (8 * i)) & 0xff;
+
+	// Grava num temporário e renomeia por cima do anterior.
+	if (!g_file_set_contents(path, (gchar *)buf->data, buf->len, &error)) {
+		printf("Error writing checkpoint: %s\n", error->message);
+		g_error_free(error);
+		return -1;
+	}
+
+	return 0;
+}
+
+int checkpoint_open(char *path, struct checkpoint_reader *reader) {
+	struct stat st;
+	guint32 crc = 0;
+	int fd;
+
+	memset(reader, 0, sizeof(struct checkpoint_reader));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if ((fstat(fd, &st) < 0) || (st.st_size < HEADER_SIZE)) {
+		close(fd);
+		return -1;
+	}
+
+	reader->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (reader->data == MAP_FAILED) {
+		reader->data = NULL;
+		return -1;
+	}
+	reader->size = st.st_size;
+	madvise(reader->data, reader->size, MADV_SEQUENTIAL);
+
+	for (int i = 0; i < 4; i++)
+		crc |= (guint32)reader->data[CRC_OFFSET + i] << (8 * i);
+
+	if ((memcmp(reader->data, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0) ||
+			(reader->data[sizeof(CHECKPOINT_MAGIC)] != CHECKPOINT_VERSION) ||
+			(crc32(reader->data + HEADER_SIZE, reader->size - HEADER_SIZE) != crc)) {
+		checkpoint_close(reader);
+		return -1;
+	}
+	reader->pos = HEADER_SIZE;
+
+	return 0;
+}
+
+gint64 checkpoint_get(struct checkpoint_reader *reader) {
+	guint64 v = 0;
+	int shift = 0;
+	guint8 byte;
+
+	do {
+		if ((reader->pos >= reader->size) || (shift > 63)) {
+			reader->error = 1;
+			return 0;
+		}
+		byte = reader->data[reader->pos++];
+		v |= (guint64)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+
+	return (gint64)(v >> 1) ^ -(gint64)(v & 1);
+}
+
+void checkpoint_close(struct checkpoint_reader *reader) {
+	if (reader->data != NULL)
+		munmap(reader->data, reader->size);
+	reader->data = NULL;
+	reader->size = 0;
+}
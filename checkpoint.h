@@ -0,0 +1,37 @@
+#ifndef _CHECKPOINT_
+#define _CHECKPOINT_
+
+#include <glib.h>
+
+// Formato dos checkpoints do executor 2PL: uma sequência de inteiros em
+// varint (zigzag), sem alinhamento. Quem grava e quem lê combinam a ordem
+// dos campos; aqui só ficam a codificação e o acesso ao arquivo.
+
+#define CHECKPOINT_MAGIC "2PLCKPT"
+#define CHECKPOINT_VERSION 3
+
+// Buffer com o cabeçalho (CHECKPOINT_MAGIC, a versão e o espaço do CRC).
+GByteArray *checkpoint_new(void);
+void checkpoint_put(GByteArray *buf, gint64 value);
+// Preenche o CRC-32 do conteúdo no cabeçalho e grava buf em path de uma
+// vez: um checkpoint antigo só é substituído quando o novo está completo.
+int checkpoint_write(char *path, GByteArray *buf);
+
+// Checkpoint mapeado em memória, lido em sequência.
+struct checkpoint_reader
+{
+	guchar *data;
+	gsize size;
+	gsize pos;
+	// Campo truncado ou fora do formato.
+	int error;
+};
+
+// Mapeia path e confere o cabeçalho e o CRC antes de qualquer leitura.
+// Retorna -1 se o arquivo não abre, não é um checkpoint desta versão ou
+// está corrompido.
+int checkpoint_open(char *path, struct checkpoint_reader *reader);
+gint64 checkpoint_get(struct checkpoint_reader *reader);
+void checkpoint_close(struct checkpoint_reader *reader);
+
+#endif
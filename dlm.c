@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "structs.h"
+#include "parser.h"
+#include "exec.h"
+
+// Simulação de um gerenciador de locks distribuído. As variáveis são
+// repartidas entre K sites; cada site é uma thread com a sua própria
+// instância das tabelas de lock (lock_manager_*) e conversa por filas de
+// mensagens com o gerenciador de transações (TM), que percorre a escala.
+//
+// O TM espera a resposta de cada mensagem antes de seguir, e a resposta traz
+// os grants e as arestas de espera novas que o pedido produziu no site.
+// Assim os eventos acontecem na mesma ordem em toda execução, e o TM repete
+// os passos do executor centralizado: cada passo executa uma transação
+// liberada por um grant ou a próxima operação da escala, e depois checa os
+// suspeitos de deadlock.
+//
+// Nenhum nó enxerga o grafo de espera inteiro. Deadlocks globais são
+// detectados por perseguição de arestas (Chandy-Misra-Haas): o TM entrega o
+// probe de um suspeito ao site onde ele está bloqueado, e cada site o repassa
+// direto aos sites onde esperam as transações das quais a sua depende. Se o
+// probe chega de volta ao iniciador, há um ciclo e o iniciador é a vítima.
+
+enum dlm_msg_type
+{
+	DLM_REQUEST = 0,
+	DLM_ABORT,
+	DLM_REPLY,
+	DLM_PROBE,
+	DLM_PROBE_DONE,
+	DLM_STOP
+};
+
+// Um probe em andamento, compartilhado pelos sites que o repassam. O TM só
+// começa outro quando inflight chega a zero.
+struct dlm_probe
+{
+	int id;
+	int initiator;
+	gint inflight;
+	gint found;
+};
+
+struct dlm_msg
+{
+	enum dlm_msg_type type;
+	int site;
+	int transaction;
+	struct operation *op;
+	enum op_stats status;
+	struct dlm_probe *probe;
+	// Na resposta: transações com o lock concedido e com arestas novas.
+	GSList *grants;
+	GSList *suspects;
+};
+
+struct dlm_site
+{
+	int id;
+	int leftover;
+	GAsyncQueue *queue;
+	GThread *thread;
+	// Transações já expandidas pelo probe corrente.
+	int probe_id;
+	GHashTable *expanded;
+};
+
+struct dlm_transaction
+{
+	int id;
+	int unlocked;
+	int aborted;
+	int blocked_at;
+	struct operation *blocked;
+	GQueue pending;
+	GSList *sites;
+};
+
+static struct dlm_site *sites;
+static int nsites;
+static GAsyncQueue *tm_queue;
+// Também é o diretório de onde cada transação espera: o TM só o altera entre
+// uma detecção e outra, e os sites só o leem durante o probe.
+static GHashTable *dlm_transaction_table;
+static struct exec_stats *dlm_run;
+
+// Transações liberadas por um grant e suspeitos de deadlock, na ordem em que
+// as respostas dos sites os trouxeram.
+static GQueue ready_queue;
+static GQueue suspect_queue;
+
+static gint messages;
+static gint detect_messages;
+static gint64 detect_latency;
+
+static void send_msg(GAsyncQueue *queue, struct dlm_msg *msg) {
+	g_atomic_int_inc(&messages);
+	if ((msg->type == DLM_PROBE) || (msg->type == DLM_PROBE_DONE))
+		g_atomic_int_inc(&detect_messages);
+	g_async_queue_push(queue, msg);
+}
+
+static struct dlm_msg *new_msg(enum dlm_msg_type type, int site, int transaction) {
+	struct dlm_msg *msg;
+
+	msg = g_new0(struct dlm_msg, 1);
+	msg->type = type;
+	msg->site = site;
+	msg->transaction = transaction;
+
+	return msg;
+}
+
+static int var_site(char *var) {
+	return g_str_hash(var) % nsites;
+}
+
+// Responde ao TM com os grants e as arestas de espera novas que o pedido
+// produziu nesta instância.
+static void site_reply(struct dlm_msg *msg) {
+	int id;
+
+	while (lock_manager_next_grant(&id))
+		msg->grants = g_slist_prepend(msg->grants, GINT_TO_POINTER(id));
+	msg->grants = g_slist_reverse(msg->grants);
+
+	while (lock_manager_next_suspect(&id))
+		msg->suspects = g_slist_prepend(msg->suspects, GINT_TO_POINTER(id));
+	msg->suspects = g_slist_reverse(msg->suspects);
+
+	msg->type = DLM_REPLY;
+	send_msg(tm_queue, msg);
+}
+
+// Site onde a transação id espera, ou -1.
+static int blocked_site(int id) {
+	struct dlm_transaction *t;
+
+	t = g_hash_table_lookup(dlm_transaction_table, GINT_TO_POINTER(id));
+	if ((t == NULL) || t->aborted)
+		return -1;
+
+	return t->blocked_at;
+}
+
+static void send_probe(struct dlm_probe *probe, int target, int site) {
+	struct dlm_msg *msg;
+
+	msg = new_msg(DLM_PROBE, site, target);
+	msg->probe = probe;
+	g_atomic_int_inc(&probe->inflight);
+	send_msg(sites[site].queue, msg);
+}
+
+// Só o site onde a transação espera conhece suas dependências: expande cada
+// uma uma vez por probe e repassa o probe aos sites onde elas esperam. Quem
+// consome a última mensagem do probe avisa o TM.
+static void site_probe(struct dlm_site *site, struct dlm_msg *msg) {
+	struct dlm_probe *probe = msg->probe;
+	GSList *holders = NULL;
+
+	if (site->probe_id != probe->id) {
+		g_hash_table_remove_all(site->expanded);
+		site->probe_id = probe->id;
+	}
+
+	if (!g_hash_table_contains(site->expanded, GINT_TO_POINTER(msg->transaction))) {
+		g_hash_table_add(site->expanded, GINT_TO_POINTER(msg->transaction));
+		if (lock_manager_is_blocked(msg->transaction))
+			holders = lock_manager_waits_for(msg->transaction);
+	}
+
+	for (GSList *l = holders; l != NULL; l = l->next) {
+		int id = GPOINTER_TO_INT(l->data);
+		int at;
+
+		if (id == probe->initiator)
+			g_atomic_int_set(&probe->found, 1);
+		else if ((at = blocked_site(id)) >= 0)
+			send_probe(probe, id, at);
+	}
+	g_slist_free(holders);
+
+	if (g_atomic_int_dec_and_test(&probe->inflight))
+		send_msg(tm_queue, new_msg(DLM_PROBE_DONE, site->id, probe->initiator));
+	g_free(msg);
+}
+
+static gpointer site_main(gpointer data) {
+	struct dlm_site *site = data;
+	struct exec_stats run;
+	struct dlm_msg *msg;
+
+	lock_manager_init(&run);
+	site->probe_id = -1;
+	site->expanded = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	for (;;) {
+		msg = g_async_queue_pop(site->queue);
+		switch (msg->type) {
+			case DLM_REQUEST:
+				msg->status = lock_manager_request(msg->op);
+				site_reply(msg);
+				break;
+			case DLM_ABORT:
+				lock_manager_abort(msg->transaction);
+				site_reply(msg);
+				break;
+			case DLM_PROBE:
+				site_probe(site, msg);
+				break;
+			case DLM_STOP:
+			default:
+				site->leftover = lock_manager_free();
+				// Só o site sabe se quem esperou já tinha um lock na variável.
+				g_atomic_int_add(&dlm_run->upgrade_waits, run.upgrade_waits);
+				g_hash_table_destroy(site->expanded);
+				g_free(msg);
+				return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+static struct dlm_transaction *get_transaction(int id) {
+	struct dlm_transaction *t;
+
+	t = g_hash_table_lookup(dlm_transaction_table, GINT_TO_POINTER(id));
+	if (t == NULL) {
+		t = g_new0(struct dlm_transaction, 1);
+		t->id = id;
+		t->blocked_at = -1;
+		g_queue_init(&t->pending);
+		g_hash_table_insert(dlm_transaction_table, GINT_TO_POINTER(id), t);
+	}
+
+	return t;
+}
+
+static void free_transaction(gpointer data) {
+	struct dlm_transaction *t = data;
+
+	g_queue_clear(&t->pending);
+	g_slist_free(t->sites);
+	g_free(t);
+}
+
+// Os grants vão para a fila de prontas e os suspeitos para a detecção.
+static void handle_reply(struct dlm_msg *msg) {
+	for (GSList *l = msg->grants; l != NULL; l = l->next) {
+		struct dlm_transaction *t = get_transaction(GPOINTER_TO_INT(l->data));
+
+		if (t->aborted)
+			continue;
+
+		if (verbose) {
+			printf("EXWO: ");
+			dump_operation(t->blocked);
+		}
+		t->blocked_at = -1;
+		t->blocked = NULL;
+		g_queue_push_tail(&ready_queue, t);
+	}
+
+	for (GSList *l = msg->suspects; l != NULL; l = l->next)
+		g_queue_push_tail(&suspect_queue, get_transaction(GPOINTER_TO_INT(l->data)));
+
+	g_slist_free(msg->grants);
+	g_slist_free(msg->suspects);
+}
+
+// Manda msg ao site e espera a resposta.
+static struct dlm_msg *call_site(int site, struct dlm_msg *msg) {
+	send_msg(sites[site].queue, msg);
+	msg = g_async_queue_pop(tm_queue);
+	handle_reply(msg);
+
+	return msg;
+}
+
+static void abort_transaction(struct dlm_transaction *t) {
+	t->aborted = 1;
+	t->blocked_at = -1;
+	t->blocked = NULL;
+	g_queue_clear(&t->pending);
+	printf("* ABORTING TRANSACTION: %d *\n", t->id);
+	dlm_run->aborts++;
+
+	for (GSList *l = t->sites; l != NULL; l = l->next) {
+		int site = GPOINTER_TO_INT(l->data);
+		g_free(call_site(site, new_msg(DLM_ABORT, site, t->id)));
+	}
+}
+
+static void dispatch_operation(struct dlm_transaction *t, struct operation *op) {
+	struct dlm_msg *msg;
+	int site;
+
+	// 2PL é verificado aqui: cada site só conhece os próprios unlocks.
+	if (t->unlocked && ((op->cmd == CMD_LOCK_S) || (op->cmd == CMD_LOCK_X) ||
+				(op->cmd == CMD_LOCK_U))) {
+		printf("ERROR: ");
+		dump_operation(op);
+		abort_transaction(t);
+		return;
+	}
+
+	site = var_site(op->var);
+	if (g_slist_find(t->sites, GINT_TO_POINTER(site)) == NULL)
+		t->sites = g_slist_prepend(t->sites, GINT_TO_POINTER(site));
+
+	msg = new_msg(DLM_REQUEST, site, t->id);
+	msg->op = op;
+	msg = call_site(site, msg);
+
+	if (msg->status == OP_WAIT) {
+		t->blocked_at = site;
+		t->blocked = op;
+		dlm_run->waits++;
+	}
+	else if (msg->status != OP_OK) {
+		printf("ERROR: ");
+		dump_operation(op);
+		abort_transaction(t);
+	}
+	else if (op->cmd == CMD_UNLOCK) {
+		t->unlocked = 1;
+	}
+	g_free(msg);
+}
+
+// Uma transação liberada executa as operações que enfileirou enquanto
+// esperava, até terminar ou bloquear de novo.
+static void exec_ready_transaction(struct dlm_transaction *t) {
+	struct operation *op;
+
+	while (!t->aborted && (t->blocked_at < 0) && !g_queue_is_empty(&t->pending)) {
+		op = g_queue_pop_head(&t->pending);
+		if (verbose) {
+			printf("EXWO: ");
+			dump_operation(op);
+		}
+		dispatch_operation(t, op);
+	}
+}
+
+static void submit_operation(struct operation *op) {
+	struct dlm_transaction *t;
+
+	t = get_transaction(op->transaction);
+	if (t->aborted)
+		return;
+
+	if (verbose) {
+		printf("EXEC: ");
+		dump_operation(op);
+	}
+	dlm_run->operations++;
+
+	if (t->blocked_at >= 0) {
+		g_queue_push_tail(&t->pending, op);
+		return;
+	}
+
+	dispatch_operation(t, op);
+}
+
+// Persegue as arestas a partir de t e espera o probe se esgotar. Retorna 1
+// se ele voltou a t.
+static int probe_cycle(struct dlm_transaction *t) {
+	static int next_probe;
+	struct dlm_probe probe;
+	struct dlm_msg *msg;
+
+	probe.id = next_probe++;
+	probe.initiator = t->id;
+	probe.inflight = 0;
+	probe.found = 0;
+	send_probe(&probe, t->id, t->blocked_at);
+
+	msg = g_async_queue_pop(tm_queue);
+	g_free(msg);
+
+	return g_atomic_int_get(&probe.found);
+}
+
+// Checa cada transação que ganhou uma aresta de espera nova; a que fecha um
+// ciclo é a vítima, como no executor centralizado.
+static void detect_deadlocks(void) {
+	struct dlm_transaction *t;
+	gint64 start;
+
+	while ((t = g_queue_pop_head(&suspect_queue)) != NULL) {
+		if (t->aborted || (t->blocked_at < 0))
+			continue;
+
+		dlm_run->detections++;
+		start = g_get_monotonic_time();
+		if (probe_cycle(t)) {
+			printf("* DEADLOCK DETECTED *\n");
+			dlm_run->deadlocks++;
+			detect_latency += g_get_monotonic_time() - start;
+			abort_transaction(t);
+		}
+	}
+}
+
+void exec_operations_dlm(GSList *op_list, int k, struct exec_stats *run) {
+	struct dlm_transaction *t;
+	GSList *next;
+	GTimer *timer;
+	int leftover = 0;
+
+	if ((op_list == NULL) || (run == NULL) || (k <= 0))
+		return;
+
+	memset(run, 0, sizeof(struct exec_stats));
+	dlm_run = run;
+	nsites = k;
+	messages = 0;
+	detect_messages = 0;
+	detect_latency = 0;
+	tm_queue = g_async_queue_new();
+	dlm_transaction_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, free_transaction);
+	g_queue_init(&ready_queue);
+	g_queue_init(&suspect_queue);
+	timer = g_timer_new();
+
+	sites = g_new0(struct dlm_site, nsites);
+	for (int i = 0; i < nsites; i++) {
+		sites[i].id = i;
+		sites[i].queue = g_async_queue_new();
+		sites[i].thread = g_thread_new("dlm-site", site_main, &sites[i]);
+	}
+
+	// Os mesmos passos do executor centralizado: uma transação liberada tem
+	// prioridade sobre a próxima operação da escala, e a detecção roda no
+	// fim de cada passo.
+	next = op_list;
+	for (;;) {
+		if ((t = g_queue_pop_head(&ready_queue)) != NULL)
+			exec_ready_transaction(t);
+		else if (next != NULL) {
+			submit_operation(next->data);
+			next = next->next;
+		}
+		else
+			break;
+
+		detect_deadlocks();
+	}
+
+	g_timer_stop(timer);
+	run->elapsed = g_timer_elapsed(timer, NULL);
+	run->transactions = g_hash_table_size(dlm_transaction_table);
+	run->committed = run->transactions - run->aborts;
+
+	for (int i = 0; i < nsites; i++) {
+		send_msg(sites[i].queue, new_msg(DLM_STOP, i, 0));
+		g_thread_join(sites[i].thread);
+		g_async_queue_unref(sites[i].queue);
+		leftover |= sites[i].leftover;
+	}
+
+	if (leftover)
+		printf("ERROR!\n");
+
+	printf("DLM:\n");
+	printf("\tsites: %d\n", nsites);
+	printf("\tmessages: %d (%d for deadlock detection)\n", messages, detect_messages);
+	printf("\tdetection latency: %.1fus average\n",
+			run->deadlocks ? (double)detect_latency / run->deadlocks : 0.0);
+
+	g_free(sites);
+	g_async_queue_unref(tm_queue);
+	g_hash_table_destroy(dlm_transaction_table);
+	g_queue_clear(&ready_queue);
+	g_queue_clear(&suspect_queue);
+	g_timer_destroy(timer);
+}
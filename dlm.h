@@ -0,0 +1,10 @@
+#ifndef _DLM_
+#define _DLM_
+
+#include <glib.h>
+
+#include "structs.h"
+
+void exec_operations_dlm(GSList *op_list, int nsites, struct exec_stats *run);
+
+#endif
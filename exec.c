@@ -5,6 +5,10 @@
 
 #include "structs.h"
 #include "parser.h"
+#include "exec.h"
+#include "interval.h"
+#include "holders.h"
+#include "checkpoint.h"
 
 enum var_lock_status
 {
@@ -13,94 +17,204 @@ enum var_lock_status
 	VAR_UNKNOWN
 };
 
-enum op_stats
+struct transaction
 {
-	OP_ERROR = 0,
-	OP_WAIT,
-	OP_OK,
-	OP_UNKNOWN
+	int id;
+	int unlocked;
+	int aborted;
+	// Lock que a transação espera e operações enfileiradas atrás dele.
+	struct operation *blocked;
+	GQueue pending;
+	// Pedidos que obtiveram os locks da transação, um por variável, para
+	// liberar no abort.
+	GSList *locks;
+	// Posição da transação nos conjuntos de donos dos locks, ou -1 se ela
+	// não tem nenhum.
+	int slot;
+	// Passo em que bloqueou e estado da busca de componentes fortes.
+	int blocked_since;
+	int scc_mark;
+	int scc_index;
+	int scc_low;
+	int scc_stacked;
 };
 
+// Pedido de lock em espera, na ordem em que bloqueou.
+struct wait_entry
+{
+	struct transaction *trans;
+	int since;
+};
+
+// Percorre as transações das quais um pedido em espera depende.
+struct blocker_iter
+{
+	struct operation *op;
+	struct holder_set *sets[3];
+	int set;
+	int slot;
+	int left;
+	// Donos de intervalos sobrepostos e conversões na frente na fila.
+	GSList *others;
+};
 
-GSList *unlocked_transaction_list = NULL;
-GSList *aborted_transaction_list = NULL;
-GSList *lock_waiting_list = NULL;
+// O estado do gerenciador de locks é por thread, para que várias instâncias
+// isoladas (os sites do modo distribuído) rodem ao mesmo tempo.
+static __thread GHashTable *transaction_table;
+static __thread GHashTable *wait_table;
+// Donos de cada variável, como holder_set sobre os slots das transações.
+static __thread GHashTable *lock_s_table;
+static __thread GHashTable *lock_u_table;
+static __thread GHashTable *lock_x_table;
+// Transação de cada slot. Os slots livres são reaproveitados, para manter
+// os conjuntos pequenos mesmo com muitas transações na escala.
+static __thread GPtrArray *slot_table;
+static __thread GArray *free_slots;
+
+// Variável ou intervalo distinto num índice ordenado. O índice tem a sua
+// cópia dos limites: no modo -s os pedidos são liberados quando a transação
+// termina, e a chave pode continuar em uso por outras.
+struct indexed_key
+{
+	char *var;
+	char *low;
+	char *high;
+	struct interval_node *node;
+	// No lock_index, os donos da variável em lock_x_table, lock_u_table e
+	// lock_s_table, para a busca não consultar as tabelas a cada chave.
+	struct holder_set *sets[3];
+};
 
-GHashTable *wait_table;
-GHashTable *lock_s_table;
-GHashTable *lock_x_table;
+struct key_index
+{
+	struct interval_tree *tree;
+	// Nó de cada variável indexada, para tirá-la da árvore.
+	GHashTable *keys;
+};
 
-static void abort_transaction(struct operation *op);
+// Variáveis e intervalos com algum lock concedido, um nó por chave: os donos
+// de cada uma ficam nos bitsets. Só é montado no primeiro pedido de
+// intervalo; até lá as tabelas de hash bastam.
+static __thread struct key_index *lock_index;
+// As variáveis com fila em wait_table, montado junto com lock_index: um lock
+// liberado ou concedido só olha as filas sobrepostas.
+static __thread struct key_index *wait_index;
+
+// Transações liberadas por um grant, prontas para continuar.
+static __thread GQueue *ready_queue;
+// Transações com arestas de espera novas, a serem checadas por deadlock.
+static __thread GQueue *deadlock_queue;
+// Pedidos em espera, do mais antigo ao mais novo.
+static __thread GQueue *blocked_queue;
+
+int verbose = 1;
+struct detect_policy detect_policy;
+struct checkpoint_policy checkpoint_policy;
+volatile sig_atomic_t checkpoint_requested;
+// Para onde vão o rastro e os avisos desta thread; NULL é a saída padrão.
+static __thread FILE *output;
+static __thread int tracing;
+static __thread struct exec_stats *stats_run;
+static __thread GTimer *detect_timer;
+static __thread int step;
+static __thread int blocked_count;
+static __thread int last_detection;
+static __thread int scc_mark;
+// Resumo das operações já consumidas da escala, gravado nos checkpoints.
+static __thread guint64 schedule_hash;
+
+static void abort_transaction(struct transaction *trans);
+static int is_conversion(struct operation *op);
+static void blockers_init(struct blocker_iter *it, struct operation *op);
+static struct transaction *blockers_next(struct blocker_iter *it);
+static void blockers_clear(struct blocker_iter *it);
+
+static FILE *out() {
+	return output ? output : stdout;
+}
 
-int compare_trans(gconstpointer a, gconstpointer b) {
-	return g_strcmp0(a, b);
+void exec_set_output(FILE *file) {
+	output = file;
 }
 
 void dump_operation(struct operation *op) {
 	if (op == NULL)
 		return;
 
-	printf("[%d] [%s] [%s]\n", op->transaction, cmd_to_strcmd(op->cmd), op->var);
+	fprintf(out(), "[%d] [%s] [%s]\n", op->transaction, cmd_to_strcmd(op->cmd), op->var);
+}
+
+void dump_stats(struct exec_stats *stats) {
+	if (stats == NULL)
+		return;
+
+	fprintf(out(), "STATS:\n");
+	fprintf(out(), "\toperations: %d\n", stats->operations);
+	fprintf(out(), "\ttransactions: %d (%d committed)\n", stats->transactions, stats->committed);
+	fprintf(out(), "\twaits: %d (%d upgrades)\n", stats->waits, stats->upgrade_waits);
+	fprintf(out(), "\tdeadlocks: %d (%.2f extra steps stuck on average)\n", stats->deadlocks,
+			stats->deadlocks ? (double)stats->deadlock_delay / stats->deadlocks : 0.0);
+	fprintf(out(), "\tdetections: %d (%.6fs)\n", stats->detections, stats->detect_time);
+	fprintf(out(), "\taborts: %d (%.2f%%)\n", stats->aborts,
+			stats->transactions ? (100.0 * stats->aborts) / stats->transactions : 0.0);
+	fprintf(out(), "\telapsed: %.6fs (%.0f ops/s, %.0f commits/s)\n", stats->elapsed,
+			stats->elapsed > 0 ? stats->operations / stats->elapsed : 0.0,
+			stats->elapsed > 0 ? stats->committed / stats->elapsed : 0.0);
 }
 
 #ifdef DEBUG
-static void dump_list(gpointer data, gpointer userdata)
+static void dump_unlocked(gpointer key, gpointer value, gpointer userdata)
 {
-	char *strtrans;
+	struct transaction *trans = value;
 
-	if (data == NULL)
-		return;
+	if (trans->unlocked && !trans->aborted)
+		fprintf(out(), "\t%d\n", trans->id);
+}
+
+static void dump_aborted(gpointer key, gpointer value, gpointer userdata)
+{
+	struct transaction *trans = value;
 
-	strtrans = (char *)data;
-	printf("\t%s\n", strtrans);
+	if (trans->aborted)
+		fprintf(out(), "\t%d\n", trans->id);
 }
 
 static void dump_unlocked_list()
 {
-	if (g_slist_length(unlocked_transaction_list) == 0)
-		return;
-
-	printf("UNLOCKED LIST:\n");
-	g_slist_foreach(unlocked_transaction_list, dump_list, NULL);
+	fprintf(out(), "UNLOCKED LIST:\n");
+	g_hash_table_foreach(transaction_table, dump_unlocked, NULL);
 }
 
 static void dump_aborted_list()
 {
-	if (g_slist_length(aborted_transaction_list) == 0)
-		return;
-
-	printf("ABORTED LIST:\n");
-	g_slist_foreach(aborted_transaction_list, dump_list, NULL);
+	fprintf(out(), "ABORTED LIST:\n");
+	g_hash_table_foreach(transaction_table, dump_aborted, NULL);
 }
 
-
 static void dump_table_list(gpointer key, gpointer value, gpointer userdata)
 {
-	struct operation *op;
-	char *table_type;
-
 	if (key == NULL)
 		return;
 
-	GSList *transactions = (GSList *)value;
-	if (transactions == NULL)
+	struct holder_set *set = value;
+	if (set == NULL)
 		return;
 
-	table_type = (char *)userdata;
+	fprintf(out(), "\t%s:\n", (char *)key);
+	for (int slot = holder_set_next(set, 0); slot >= 0; slot = holder_set_next(set, slot + 1)) {
+		struct transaction *t = g_ptr_array_index(slot_table, slot);
+		fprintf(out(), "\t\t%d\n", t->id);
+	}
+}
 
-	printf("\t%s:\n", key);
-	for (int i = 0; i < g_slist_length(transactions); i++) {
-		if (g_strcmp0(table_type, "wait_table") == 0) {
-			op = (struct operation *)g_slist_nth_data(transactions, i);
-			if (op != NULL) {
-				printf("\t");
-				dump_operation(op);
-			}
-		}
-		else {
-			int *t = (int *)g_slist_nth_data(transactions, i);
-			printf("\t\t%d\n", *t);
-		}
+static void dump_wait_list(gpointer key, gpointer value, gpointer userdata)
+{
+	GQueue *queue = (GQueue *)value;
+
+	fprintf(out(), "\t%s:\n", (char *)key);
+	for (GList *l = queue->head; l != NULL; l = l->next) {
+		fprintf(out(), "\t");
+		dump_operation(l->data);
 	}
 }
 
@@ -108,624 +222,1322 @@ static void dump_lock_s_table() {
 	if (lock_s_table == NULL)
 		return;
 
-	printf("S LOCK TABLE:\n");
+	fprintf(out(), "S LOCK TABLE:\n");
 	g_hash_table_foreach(lock_s_table, dump_table_list, NULL);
-	printf("\n");
+	fprintf(out(), "\n");
+}
+
+static void dump_lock_u_table() {
+	if (lock_u_table == NULL)
+		return;
+
+	fprintf(out(), "U LOCK TABLE:\n");
+	g_hash_table_foreach(lock_u_table, dump_table_list, NULL);
+	fprintf(out(), "\n");
 }
 
 static void dump_lock_x_table() {
 	if (lock_x_table == NULL)
 		return;
 
-	printf("X LOCK TABLE:\n");
+	fprintf(out(), "X LOCK TABLE:\n");
 	g_hash_table_foreach(lock_x_table, dump_table_list, NULL);
-	printf("\n");
+	fprintf(out(), "\n");
 }
 
 static void dump_wait_table() {
 	if (wait_table == NULL)
 		return;
 
-	printf("WAIT TABLE:\n");
-	g_hash_table_foreach(wait_table, dump_table_list, "wait_table");
-	printf("\n");
+	fprintf(out(), "WAIT TABLE:\n");
+	g_hash_table_foreach(wait_table, dump_wait_list, NULL);
+	fprintf(out(), "\n");
 }
 #endif
 
-// Checa se t1 trava t2
-static int is_locking(int t1, int t2) {
-	char *strt1 = g_strdup_printf("%d", t1);
+static struct transaction *get_transaction(int id) {
+	struct transaction *trans;
 
-	GSList *op_list = g_hash_table_lookup(wait_table, strt1);
-	g_free(strt1);
+	trans = g_hash_table_lookup(transaction_table, GINT_TO_POINTER(id));
+	if (trans == NULL) {
+		trans = g_new0(struct transaction, 1);
+		trans->id = id;
+		trans->slot = -1;
+		g_queue_init(&trans->pending);
+		g_hash_table_insert(transaction_table, GINT_TO_POINTER(id), trans);
+	}
 
-	if (g_slist_length(op_list) == 0)
-		return 0;
+	return trans;
+}
 
-	struct operation *op = g_slist_nth_data(op_list, 0);
-	if (op == NULL)
-		return 0;
+static void free_transaction(gpointer data) {
+	struct transaction *trans = data;
 
-	GSList *xlock_list = g_hash_table_lookup(lock_x_table, op->var);
-	if (xlock_list != NULL) {
-		for (int j = 0; j < g_slist_length(xlock_list); j++) {
-			struct operation *tmp_op = g_slist_nth_data(xlock_list, j);
-			if (t2 == tmp_op->transaction) {
-				return 1;
-			}
-		}
-	}
+	g_queue_clear(&trans->pending);
+	g_slist_free(trans->locks);
+	g_free(trans);
+}
 
-	// Apenas um X_LOCK pode ser bloqueado por um S_LOCK
-	if (op->cmd == CMD_LOCK_X) {
-		GSList *slock_list = g_hash_table_lookup(lock_s_table, op->var);
-		if (slock_list != NULL) {
-			for (int j = 0; j < g_slist_length(slock_list); j++) {
-				struct operation *tmp_op = g_slist_nth_data(slock_list, j);
-				if (t2 == tmp_op->transaction) {
-					return 1;
-				}
-			}
-		}
-	}
+static void take_slot(struct transaction *trans) {
+	if (trans->slot >= 0)
+		return;
 
-	return 0;
+	if (free_slots->len > 0) {
+		trans->slot = g_array_index(free_slots, int, free_slots->len - 1);
+		g_array_set_size(free_slots, free_slots->len - 1);
+		g_ptr_array_index(slot_table, trans->slot) = trans;
+	}
+	else {
+		trans->slot = slot_table->len;
+		g_ptr_array_add(slot_table, trans);
+	}
 }
 
-static void check_deadlocks() {
-	int key1, key2;
-	char *sk1, *sk2;
-
-	if (lock_waiting_list == NULL)
+// Só depois que a transação soltou todos os locks.
+static void drop_slot(struct transaction *trans) {
+	if ((trans->slot < 0) || (trans->locks != NULL))
 		return;
 
-	GList *trans_waiting = g_hash_table_get_keys(wait_table);
+	g_ptr_array_index(slot_table, trans->slot) = NULL;
+	g_array_append_val(free_slots, trans->slot);
+	trans->slot = -1;
+}
+
+static int holds_lock(GHashTable *table, char *var, struct transaction *trans) {
+	return holder_set_contains(g_hash_table_lookup(table, var), trans->slot);
+}
+
+// Checa, em profundidade, se alguma transação da qual t espera chega de
+// volta em origin pelo grafo de espera.
+static int waits_for(struct transaction *t, struct transaction *origin, GHashTable *visited) {
+	struct blocker_iter it;
+	struct transaction *h;
+	int found = 0;
+
+	blockers_init(&it, t->blocked);
+	while (!found && ((h = blockers_next(&it)) != NULL)) {
+		if (h == origin) {
+			found = 1;
+			break;
+		}
 
-	for (int i = 0; i < g_list_length(trans_waiting); i++) {
-		sk1 = g_list_nth_data(trans_waiting, i);
-		if (sk1 == NULL)
+		if ((h->blocked == NULL) || g_hash_table_contains(visited, h))
 			continue;
 
-		for (int j = 0; j < g_list_length(trans_waiting); j++) {
-			sk2 = g_list_nth_data(trans_waiting, j);
-			if (sk2 == NULL)
-				continue;
+		g_hash_table_add(visited, h);
+		found = waits_for(h, origin, visited);
+	}
+	blockers_clear(&it);
 
-			key1 = atoi(sk1);
-			key2 = atoi(sk2);
-			if (key1 == key2)
-				continue;
+	return found;
+}
 
-			if (is_locking(key1, key2) && is_locking(key2, key1)) {
-				printf("* DEADLOCK DETECTED *\n");
+static int periodic_detection() {
+	return detect_policy.interval || detect_policy.blocked || detect_policy.waited;
+}
 
-				// Selecionando pela operação mais velha
-				sk1 = g_strdup_printf("%d", key1);
-				GSList *op_list = g_hash_table_lookup(wait_table, sk1);
-				g_free(sk1);
+// Só procura ciclos a partir das transações que ganharam uma aresta de espera
+// nova; qualquer ciclo novo passa obrigatoriamente por uma delas.
+static int check_deadlocks() {
+	struct transaction *trans;
+	GHashTable *visited;
+	int victims = 0;
 
-				if (g_slist_length(op_list) == 0)
-					continue;
+	while ((trans = g_queue_pop_head(deadlock_queue)) != NULL) {
+		if (trans->aborted || (trans->blocked == NULL))
+			continue;
 
-				struct operation *op = g_slist_nth_data(op_list, 0);
-				if (op == NULL)
-					continue;
+		visited = g_hash_table_new(g_direct_hash, g_direct_equal);
+		if (waits_for(trans, trans, visited)) {
+			// Detectado no mesmo passo em que o ciclo fechou: sem atraso.
+			fprintf(out(), "* DEADLOCK DETECTED *\n");
+			stats_run->deadlocks++;
+			victims++;
 
-				abort_transaction(op);
-				return;
-			}
+			// A vítima é a transação cujo pedido fechou o ciclo.
+			abort_transaction(trans);
 		}
+		g_hash_table_destroy(visited);
 	}
+
+	return victims;
 }
 
-static int is_transaction_waiting(struct operation *op) {
-	char *strtrans = g_strdup_printf("%d", op->transaction);
-	struct operation *tmp_op;
+static void scc_reset(struct transaction *t) {
+	t->scc_mark = scc_mark;
+	t->scc_index = 0;
+	t->scc_stacked = 0;
+}
 
-	if (op == NULL)
-		return 0;
+// Tarjan sobre o grafo de espera. Com explore, segue para qualquer transação
+// bloqueada alcançável; sem, fica nas marcadas com scc_mark. Componentes com
+// mais de uma transação contêm ciclos.
+static void strong_connect(struct transaction *t, int explore, int *index, GQueue *stack,
+		GSList **components) {
+	struct blocker_iter it;
+	GSList *component = NULL;
+	struct transaction *h;
+
+	t->scc_index = t->scc_low = ++(*index);
+	t->scc_stacked = 1;
+	g_queue_push_head(stack, t);
+
+	blockers_init(&it, t->blocked);
+	while ((h = blockers_next(&it)) != NULL) {
+		if (h->aborted || (h->blocked == NULL))
+			continue;
 
-	GSList *op_list = g_hash_table_lookup(wait_table, strtrans);
+		if (h->scc_mark != scc_mark) {
+			if (!explore)
+				continue;
+			scc_reset(h);
+		}
 
-	if (op_list != NULL) {
-		for (int i = 0; i < g_slist_length(op_list); i++) {
-			tmp_op = g_slist_nth_data(op_list, i);
-			if (((tmp_op->cmd == CMD_LOCK_S) || (tmp_op->cmd == CMD_LOCK_X)))
-				return 1;
+		if (h->scc_index == 0) {
+			strong_connect(h, explore, index, stack, components);
+			t->scc_low = MIN(t->scc_low, h->scc_low);
+		}
+		else if (h->scc_stacked) {
+			t->scc_low = MIN(t->scc_low, h->scc_index);
 		}
 	}
+	blockers_clear(&it);
 
-	return 0;
-}
-
-static void add_transaction_to_wait(struct operation *op) {
-	if (op == NULL)
+	if (t->scc_low != t->scc_index)
 		return;
 
-	char *strtrans = g_strdup_printf("%d", op->transaction);
-	if (strtrans == NULL)
-		return;
+	do {
+		h = g_queue_pop_head(stack);
+		h->scc_stacked = 0;
+		component = g_slist_prepend(component, h);
+	} while (h != t);
 
-#ifdef DEBUG
-	printf("ADDING TO WAIT: ");
-	dump_operation(op);
-#endif
+	if (component->next != NULL)
+		*components = g_slist_prepend(*components, component);
+	else
+		g_slist_free(component);
+}
 
-	GSList *op_list = g_hash_table_lookup(wait_table, strtrans);
-	op_list = g_slist_append(op_list, op);
-	g_hash_table_insert(wait_table, strtrans, op_list);
+// Componentes com ciclos que passam por nodes, na ordem em que são achados.
+static GSList *find_components(GSList *nodes, int explore) {
+	GSList *components = NULL;
+	GQueue stack = G_QUEUE_INIT;
+	int index = 0;
 
-	// Para ser checado depois pelo analisador de deadlocks.
-	if ((op->cmd == CMD_LOCK_X) || (op->cmd == CMD_LOCK_S))
-		lock_waiting_list = g_slist_append(lock_waiting_list, op);
-}
+	scc_mark++;
+	for (GSList *l = nodes; l != NULL; l = l->next)
+		scc_reset(l->data);
 
-static void remove_transaction_from_wait(struct operation *op) {
-	if (op == NULL)
-		return;
+	for (GSList *l = nodes; l != NULL; l = l->next) {
+		struct transaction *t = l->data;
+		if (!t->aborted && (t->blocked != NULL) && (t->scc_index == 0))
+			strong_connect(t, explore, &index, &stack, &components);
+	}
 
-	char *strtrans = g_strdup_printf("%d", op->transaction);
-	if (strtrans == NULL)
-		return;
+	return g_slist_reverse(components);
+}
 
-	GSList *op_list = g_hash_table_lookup(wait_table, strtrans);
-	op_list = g_slist_remove(op_list, op);
-//	if (g_slist_length(op_list) == 0)
-//		g_hash_table_remove(wait_table, strtrans);
-//	else
-		g_hash_table_insert(wait_table, strtrans, op_list);
+// Vítima de um componente: a transação que bloqueou por último, que é a que
+// fechou o ciclo.
+static struct transaction *pick_victim(GSList *component) {
+	struct transaction *victim = NULL;
+	int since = 0;
+
+	for (GSList *l = component; l != NULL; l = l->next) {
+		struct transaction *t = l->data;
+		since = MAX(since, t->blocked_since);
+		if ((victim == NULL) || (t->blocked_since > victim->blocked_since) ||
+				((t->blocked_since == victim->blocked_since) && (t->id > victim->id)))
+			victim = t;
+	}
 
-/*	if (g_hash_table_size(wait_table) == 0) {
-		g_hash_table_destroy(wait_table);
-		wait_table = NULL;
-	}*/
+	fprintf(out(), "* DEADLOCK DETECTED *\n");
+	stats_run->deadlocks++;
+	// O ciclo está fechado pelo menos desde o último bloqueio entre seus
+	// membros (se fechou por um grant, isso superestima o atraso).
+	stats_run->deadlock_delay += step - since;
 
-	lock_waiting_list = g_slist_remove(lock_waiting_list, op);
+	return victim;
 }
 
-int did_unlocked(struct operation *op) {
-	char *strtrans;
-	GSList *t = NULL;
-
-	strtrans = g_strdup_printf("%d", op->transaction);
-	if (strtrans == NULL)
-		return -1;
+static gint trans_id_cmp(gconstpointer a, gconstpointer b) {
+	return ((struct transaction *)a)->id - ((struct transaction *)b)->id;
+}
 
-	// Checando se a transição já fez unlocks
-	t = g_slist_find_custom(unlocked_transaction_list, strtrans, compare_trans);
-	g_free(strtrans);
-	if (t != NULL)
-		return 1;
+// Detecção em lote. Um ciclo novo passa por uma transação que bloqueou desde
+// a última passada (a outra ponta de uma aresta criada por um grant só entra
+// num ciclo quando bloqueia depois), então o Tarjan parte só delas. Cada
+// componente perde uma vítima; depois dos aborts, só o resto dos componentes
+// afetados é checado de novo. Abortar só tira arestas de dentro deles, e
+// quem ganha um lock com isso deixa de estar bloqueado.
+static int detect_all_deadlocks() {
+	GSList *nodes = NULL;
+	GSList *victims, *components;
+	struct transaction *trans;
+	int explore = 1, n = 0;
+
+	while ((trans = g_queue_pop_head(deadlock_queue)) != NULL)
+		nodes = g_slist_prepend(nodes, trans);
+	nodes = g_slist_reverse(nodes);
+
+	while (nodes != NULL) {
+		components = find_components(nodes, explore);
+		g_slist_free(nodes);
+		nodes = NULL;
+		victims = NULL;
+
+		for (GSList *l = components; l != NULL; l = l->next) {
+			struct transaction *victim = pick_victim(l->data);
+
+			victim->aborted = 1;
+			victims = g_slist_prepend(victims, victim);
+			for (GSList *m = l->data; m != NULL; m = m->next) {
+				if (m->data != victim)
+					nodes = g_slist_prepend(nodes, m->data);
+			}
+			g_slist_free(l->data);
+		}
+		g_slist_free(components);
+
+		// Os aborts (e os grants que eles liberam) saem em ordem de id.
+		victims = g_slist_sort(victims, trans_id_cmp);
+		for (GSList *l = victims; l != NULL; l = l->next)
+			abort_transaction(l->data);
+		n += g_slist_length(victims);
+		g_slist_free(victims);
+		explore = 0;
+	}
 
-	return 0;
+	return n;
 }
 
-static enum op_stats unlock_variable(struct operation *op, int force) {
-	GSList *t = NULL;
-	struct operation *tmp_op;
-	enum op_stats stats;
-	char *strtrans;
+static int detect_deadlocks() {
+	int victims;
 
-	if (op == NULL)
-		return OP_ERROR;
+	g_timer_continue(detect_timer);
+	stats_run->detections++;
+	last_detection = step;
 
-	if (is_transaction_waiting(op) && !force)
-		return OP_WAIT;
+	if (periodic_detection())
+		victims = detect_all_deadlocks();
+	else
+		victims = check_deadlocks();
 
-	stats = OP_ERROR;
-
-	t = g_hash_table_lookup(lock_x_table, op->var);
-	if (t != NULL) {
-		for (int i = 0; i < g_slist_length(t); i++) {
-			tmp_op = g_slist_nth_data(t, i);
-			if (op->transaction == tmp_op->transaction) {
-				t = g_slist_remove(t, tmp_op);
-				g_hash_table_insert(lock_x_table, op->var, t);
-				if (g_slist_length(t) == 0) {
-					g_hash_table_remove(lock_x_table, op->var);
-					g_slist_free(t);
-					t = NULL;
-				}
-				stats = OP_OK;
-				break;
-			}
-		}
-	}
+	g_timer_stop(detect_timer);
 
-	if (g_hash_table_size(lock_x_table) == 0) {
-		g_hash_table_destroy(lock_x_table);
-		lock_x_table = g_hash_table_new(g_str_hash, g_str_equal);
-	}
+	return victims;
+}
 
-	if (stats == OP_OK)
-		goto END;
-
-	t = g_hash_table_lookup(lock_s_table, op->var);
-	if (t != NULL) {
-		for (int i = 0; i < g_slist_length(t); i++) {
-			tmp_op = g_slist_nth_data(t, i);
-			if (op->transaction == tmp_op->transaction) {
-				t = g_slist_remove(t, tmp_op);
-				g_hash_table_insert(lock_s_table, op->var, t);
-				if (g_slist_length(t) == 0) {
-					g_hash_table_remove(lock_s_table, op->var);
-					g_slist_free(t);
-					t = NULL;
-				}
-				stats = OP_OK;
-				break;
-			}
-		}
-	}
-	if (g_hash_table_size(lock_s_table) == 0) {
-		g_hash_table_destroy(lock_s_table);
-		lock_s_table = g_hash_table_new(g_str_hash, g_str_equal);
-	}
+// Idade, em passos, do pedido em espera mais antigo. Cada pedido só dispara
+// a detecção uma vez.
+static int oldest_wait() {
+	struct wait_entry *entry;
+	int age;
 
-END:
-	if (stats == OP_OK) {
-		if (!did_unlocked(op)) {
-			strtrans = g_strdup_printf("%d", op->transaction);
-			unlocked_transaction_list = g_slist_append(unlocked_transaction_list, strtrans);
-		}
+	while ((entry = g_queue_peek_head(blocked_queue)) != NULL) {
+		if (!entry->trans->aborted && (entry->trans->blocked != NULL) &&
+				(entry->trans->blocked_since == entry->since))
+			break;
+		g_free(g_queue_pop_head(blocked_queue));
 	}
 
-	return stats;
+	if (entry == NULL)
+		return 0;
+
+	age = step - entry->since;
+	if (age >= detect_policy.waited)
+		g_free(g_queue_pop_head(blocked_queue));
+
+	return age;
 }
 
-static int did_aborted(struct operation *op) {
-	char *strtrans;
-	GSList *t = NULL;
+// Escalonador da detecção: sem política configurada, roda sempre que há
+// aresta de espera nova; com política, a cada N passos, quando o número de
+// bloqueados atinge o limite ou quando um pedido esperou M passos.
+static int should_detect() {
+	if (!periodic_detection())
+		return !g_queue_is_empty(deadlock_queue);
 
-	strtrans = g_strdup_printf("%d", op->transaction);
-	if (strtrans == NULL)
-		return -1;
+	// Sem transação bloqueada desde a última passada não há ciclo novo.
+	if ((blocked_count == 0) || g_queue_is_empty(deadlock_queue))
+		return 0;
 
-	t = g_slist_find_custom(aborted_transaction_list, strtrans, compare_trans);
-	g_free(strtrans);
-	if (t != NULL) {
+	if (detect_policy.blocked && (blocked_count >= detect_policy.blocked))
 		return 1;
-	}
 
-	return 0;
-}
+	if (detect_policy.interval && (step - last_detection >= detect_policy.interval))
+		return 1;
 
-static void abort_transaction(struct operation *op) {
-	char *strtrans;
-	GList *keys = NULL;
-	GSList *op_list = NULL;
-
-	strtrans = g_strdup_printf("%d", op->transaction);
-	aborted_transaction_list = g_slist_append(aborted_transaction_list, strtrans);
-	printf("* ABORTING TRANSACTION: %s *\n", strtrans);
-
-	// Removendo das tabelas de lock_s
-	keys = g_hash_table_get_keys(lock_s_table);
-	for (int i = 0; i < g_list_length(keys); i++) {
-		char *key = g_list_nth_data(keys, i);
-		op_list = g_hash_table_lookup(lock_s_table, key);
-		for (int j = 0; j < g_slist_length(op_list); j++) {
-			struct operation *tmp_op = g_slist_nth_data(op_list, j);
-			if (op->transaction == tmp_op->transaction)
-				op_list = g_slist_remove(op_list, tmp_op);
-		}
-		if (g_slist_length(op_list) == 0) {
-			g_hash_table_remove(lock_s_table, key);
-			g_slist_free(op_list);
-		}
-		else {
-			g_hash_table_insert(lock_s_table, key, op_list);
-		}
-	}
+	if (detect_policy.waited && (oldest_wait() >= detect_policy.waited))
+		return 1;
 
-	// Removendo das tabelas de lock_x
-	keys = g_hash_table_get_keys(lock_x_table);
-	for (int i = 0; i < g_list_length(keys); i++) {
-		char *key = g_list_nth_data(keys, i);
-		op_list = g_hash_table_lookup(lock_x_table, key);
-		for (int j = 0; j < g_slist_length(op_list); j++) {
-			struct operation *tmp_op = g_slist_nth_data(op_list, j);
-			if (op->transaction == tmp_op->transaction)
-				op_list = g_slist_remove(op_list, tmp_op);
-		}
-		if (g_slist_length(op_list) == 0) {
-			g_hash_table_remove(lock_x_table, key);
-			g_slist_free(op_list);
-		}
-		else {
-			g_hash_table_insert(lock_x_table, key, op_list);
-		}
-	}
+	return 0;
+}
 
+static int is_transaction_waiting(struct operation *op) {
+	if (op == NULL)
+		return 0;
 
-	op_list = g_hash_table_lookup(wait_table, strtrans);
-	unlock_variable(op, 1);
-	if (op_list != NULL) {
-		g_hash_table_remove(wait_table, strtrans);
-		g_slist_free(op_list);
-#ifdef DEBUG
-		dump_wait_table();
-#endif
-	}
+	return get_transaction(op->transaction)->blocked != NULL;
 }
 
-static enum op_stats can_s_lock(struct operation *op) {
-	GSList *t = NULL;
-
-	if (did_unlocked(op))
-		return OP_ERROR;
+static char *op_low(struct operation *op) {
+	return op->low ? op->low : op->var;
+}
 
-	// Checando se a variável já foi bloqueada exclusivamente por alguma
-	// transição.
-	t = g_hash_table_lookup(lock_x_table, op->var);
-	if (t != NULL)
-		return OP_WAIT;
+static void free_indexed_key(gpointer data) {
+	struct indexed_key *key = data;
 
-	return OP_OK;
+	if (key->low != key->var)
+		g_free(key->low);
+	g_free(key->var);
+	g_free(key->high);
+	g_free(key);
 }
 
-static enum op_stats can_x_lock(struct operation *op) {
-	GSList *t = NULL;
-	struct operation *tmp_op;
+static struct key_index *key_index_new() {
+	struct key_index *index = g_new(struct key_index, 1);
 
-	if (did_unlocked(op))
-		return OP_ERROR;
+	index->tree = interval_tree_new();
+	index->keys = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_indexed_key);
 
-	// Checando se a variável já foi bloqueada exclusivamente por alguma
-	// outra transição.
-	t = g_hash_table_lookup(lock_x_table, op->var);
-	if (t != NULL) {
-		for (int i = 0; i < g_slist_length(t); i++) {
-			tmp_op = g_slist_nth_data(t, i);
-			if (tmp_op->transaction == op->transaction)
-				continue;
-			else
-				return OP_WAIT;
-		}
-	}
+	return index;
+}
 
-	// Checando se a variável já foi bloqueada de maneira compartilhada por
-	// alguma outra transição.
-	t = g_hash_table_lookup(lock_s_table, op->var);
-	if (t != NULL) {
-		for (int i = 0; i < g_slist_length(t); i++) {
-			tmp_op = g_slist_nth_data(t, i);
-			if (tmp_op->transaction == op->transaction)
-				continue;
-			else
-				return OP_WAIT;
-		}
-	}
+static void key_index_free(struct key_index *index) {
+	if (index == NULL)
+		return;
 
-	return OP_OK;
+	interval_tree_free(index->tree);
+	g_hash_table_destroy(index->keys);
+	g_free(index);
 }
 
-static enum op_stats can_write(struct operation *op) {
-	GSList *t = NULL;
-	struct operation *tmpop;
-	char *var;
-	int trans;
+// Indexa a variável de op, se ela ainda não está no índice.
+static void key_index_add(struct key_index *index, struct operation *op) {
+	struct indexed_key *key;
 
-	if (op == NULL) {
-		return OP_ERROR;
-	}
+	if (g_hash_table_contains(index->keys, op->var))
+		return;
 
-	if (is_transaction_waiting(op))
-		return OP_WAIT;
+	key = g_new0(struct indexed_key, 1);
+	key->var = g_strdup(op->var);
+	// Um ponto começa no próprio nome.
+	key->low = op->low ? g_strdup(op->low) : key->var;
+	key->high = g_strdup(op->high);
+	key->node = interval_tree_insert(index->tree, key->low, key->high, key);
+	g_hash_table_insert(index->keys, key->var, key);
+}
 
-	var = op->var;
-	trans = op->transaction;
+static void key_index_remove(struct key_index *index, char *var) {
+	struct indexed_key *key = g_hash_table_lookup(index->keys, var);
 
-	// Checando se a variável já foi bloqueada exclusivamente pela transição.
-	t = g_hash_table_lookup(lock_x_table, var);
-	if (t != NULL) {
-		for (int i = 0; i < g_slist_length(t); i++) {
-			tmpop = g_slist_nth_data(t, i);
-			if (tmpop->transaction == trans)
-				return OP_OK;
-		}
-	}
+	if (key == NULL)
+		return;
 
-	return OP_ERROR;
+	interval_tree_remove(index->tree, key->node);
+	g_hash_table_remove(index->keys, var);
 }
 
-static enum op_stats can_read(struct operation *op) {
-	GSList *t = NULL;
-	struct operation *tmpop;
-	enum op_stats stats;
-	char *var;
-	int trans;
-
-	if (op == NULL)
-		return OP_ERROR;
+// Visita as chaves que se sobrepõem a [low, high) até func retornar TRUE;
+// devolve essa chave, ou NULL.
+static struct indexed_key *key_index_find(struct key_index *index, char *low, char *high,
+		interval_func func, gpointer user_data) {
+	struct interval_node *node = interval_tree_find(index->tree, low, high, func, user_data);
 
-	stats = can_write(op);
+	return node ? interval_node_data(node) : NULL;
+}
 
-	if (stats == OP_OK)
-		return OP_OK;
-	else if (stats == OP_WAIT)
-		return OP_WAIT;
+// Fila nova de op->var em wait_table, e no índice se ele já existe.
+static GQueue *new_wait_queue(struct operation *op) {
+	GQueue *queue = g_queue_new();
 
-	var = op->var;
-	trans = op->transaction;
+	g_hash_table_insert(wait_table, op->var, queue);
+	if (wait_index != NULL)
+		key_index_add(wait_index, op);
 
-	// Checando se a variável já foi bloqueada de maneira compartilhada
-	// pela transição.
-	t = g_hash_table_lookup(lock_s_table, var);
-	if (t != NULL) {
-		for (int i = 0; i < g_slist_length(t); i++) {
-			tmpop = g_slist_nth_data(t, i);
-			if (tmpop->transaction == trans)
-				return OP_OK;
-		}
-	}
+	return queue;
+}
 
-	return OP_ERROR;
+// Descarta a fila vazia de var.
+static void drop_wait_queue(char *var) {
+	if (wait_index != NULL)
+		key_index_remove(wait_index, var);
+	g_hash_table_remove(wait_table, var);
 }
 
-static void x_lock(struct operation *op) {
-	GSList *t = NULL;
-	struct operation *tmp_op;
-
-	t = g_hash_table_lookup(lock_s_table, op->var);
-	if (t != NULL) {
-		for (int i = 0; i < g_slist_length(t); i++) {
-			tmp_op = g_slist_nth_data(t, i);
-			if (op->transaction == tmp_op->transaction) {
-				t = g_slist_remove(t, tmp_op);
-				if (g_slist_length(t) == 0) {
-					g_hash_table_remove(lock_s_table, op->var);
-					g_slist_free(t);
-					t = NULL;
-				}
-				break;
-			}
-		}
+static void add_transaction_to_wait(struct transaction *trans, struct operation *op) {
+	GQueue *queue;
+	GList *l = NULL;
+	int conversion;
+
+#ifdef DEBUG
+	fprintf(out(), "ADDING TO WAIT: ");
+	dump_operation(op);
+#endif
+
+	queue = g_hash_table_lookup(wait_table, op->var);
+	if (queue == NULL)
+		queue = new_wait_queue(op);
+
+	// Uma conversão entra depois das outras conversões, mas antes de todos
+	// os pedidos novos: quem já tem o lock fraco é atendido primeiro.
+	conversion = is_conversion(op);
+	if (conversion) {
+		for (l = queue->head; (l != NULL) && is_conversion(l->data); l = l->next)
+			;
+		stats_run->upgrade_waits++;
+	}
+	if (l != NULL)
+		g_queue_insert_before(queue, l, op);
+	else
+		g_queue_push_tail(queue, op);
+
+	trans->blocked = op;
+	trans->blocked_since = step;
+	stats_run->waits++;
+	blocked_count++;
+
+	// Para ser checado depois pelo analisador de deadlocks. Na detecção
+	// imediata, junto com os pedidos novos que agora esperam também pela
+	// conversão; na em lote, a busca parte da própria transação.
+	g_queue_push_tail(deadlock_queue, trans);
+	if (!periodic_detection()) {
+		for (; conversion && (l != NULL); l = l->next)
+			g_queue_push_tail(deadlock_queue,
+					get_transaction(((struct operation *)l->data)->transaction));
+		return;
 	}
 
-	t = g_hash_table_lookup(lock_x_table, op->var);
-	t = g_slist_append(t, &(op->transaction));
-	g_hash_table_insert(lock_x_table, op->var, t);
+	if (detect_policy.waited) {
+		struct wait_entry *entry = g_new(struct wait_entry, 1);
+		entry->trans = trans;
+		entry->since = step;
+		g_queue_push_tail(blocked_queue, entry);
+	}
 }
 
-static enum op_stats operation_status(struct operation *op) {
-	GSList *t = NULL;
-	enum op_stats stats;
+static void remove_transaction_from_wait(struct transaction *trans) {
+	struct operation *op = trans->blocked;
+	GQueue *queue;
 
 	if (op == NULL)
-		return OP_UNKNOWN;
+		return;
 
-	switch (op->cmd) {
-		case CMD_WRITE:
-			return can_write(op);
-		case CMD_READ:
-			return can_read(op);
-		case CMD_LOCK_S:
-			stats = can_s_lock(op);
-			if (stats == OP_OK) {
-				t = g_hash_table_lookup(lock_s_table, op->var);
-				t = g_slist_append(t, &(op->transaction));
-				g_hash_table_insert(lock_s_table, op->var, t);
-			}
-			return stats;
-		case CMD_LOCK_X:
-			stats = can_x_lock(op);
-			if (stats == OP_OK)
-				x_lock(op);
-			return stats;
-		case CMD_UNLOCK:
-			return unlock_variable(op, 0);
-		case CMD_UNKNOWN:
-		default:
-			break;
+	queue = g_hash_table_lookup(wait_table, op->var);
+	if (queue != NULL) {
+		g_queue_remove(queue, op);
+		if (g_queue_is_empty(queue))
+			drop_wait_queue(op->var);
 	}
 
-
-	return OP_ERROR;
+	trans->blocked = NULL;
+	blocked_count--;
 }
 
-static void cleanup_list_waiting_list(gpointer key, gpointer value, gpointer userdata) {
-	if (key == NULL)
-		return;
+static int did_unlocked(struct operation *op) {
+	return get_transaction(op->transaction)->unlocked;
+}
 
-	GSList *transactions = (GSList *)value;
-	GSList **clean_list = (GSList **)userdata;
-	if (g_slist_length(transactions) == 0)
-		*clean_list = g_slist_append(*clean_list, key);
+static int did_aborted(struct operation *op) {
+	return get_transaction(op->transaction)->aborted;
 }
 
-static void cleanup_waiting_operations() {
-	GSList *clean_list = NULL;
-	char *key;
+static enum op_stats operation_status(struct operation *op);
 
-	if (wait_table == NULL)
-		return;
+// Se um lock held impede o pedido req de outra transação: X não convive com
+// nada, U convive só com S e S com S e U.
+static int modes_conflict(enum command held, enum command req) {
+	if ((held == CMD_LOCK_X) || (req == CMD_LOCK_X))
+		return 1;
 
-	g_hash_table_foreach(wait_table, cleanup_list_waiting_list, &clean_list);
+	return (held == CMD_LOCK_U) && (req == CMD_LOCK_U);
+}
 
+// Lock concedido em outra variável que se sobrepõe a op e conflita com ele.
+// A própria variável fica com as tabelas de hash.
+static int range_conflict(struct operation *held, struct operation *op) {
+	return (held->transaction != op->transaction) && (strcmp(held->var, op->var) != 0) &&
+		modes_conflict(held->cmd, op->cmd);
+}
 
-	for (int i = 0; i < g_slist_length(clean_list); i++) {
-		key = g_slist_nth_data(clean_list, i);
-		g_hash_table_remove(wait_table, key);
-	}
+// Quantos conjuntos de donos de uma chave conflitam com o pedido op, na
+// ordem de indexed_key: X sempre, U se op for U ou X, S se op for X.
+static int conflicting_sets(struct operation *op) {
+	if (op->cmd == CMD_LOCK_X)
+		return 3;
 
-	g_slist_free(clean_list);
+	return (op->cmd == CMD_LOCK_U) ? 2 : 1;
 }
 
-static void exec_waiting_list(gpointer key, gpointer value, gpointer userdata) {
-	struct operation *op;
-	enum op_stats stats;
+// Outra variável indexada que se sobrepõe a args[0] e tem um dono, de outra
+// transação (a do slot args[1]), que conflita com ele.
+static gboolean key_conflict(gpointer data, gpointer user_data) {
+	gpointer *args = user_data;
+	struct indexed_key *key = data;
+	struct operation *op = args[0];
+	int n = conflicting_sets(op);
 
-	if (key == NULL)
-		return;
+	if (strcmp(key->var, op->var) == 0)
+		return FALSE;
 
-	GSList *transactions = (GSList *)value;
+	for (int i = 0; i < n; i++) {
+		if (holder_set_has_other(key->sets[i], GPOINTER_TO_INT(args[1])))
+			return TRUE;
+	}
 
-	for (int i = 0; i < g_slist_length(transactions); i++) {
-		op = (struct operation *)g_slist_nth_data(transactions, i);
-		stats = operation_status(op);
-		if (stats == OP_OK) {
-			printf("EXWO: ");
-			dump_operation(op);
-			remove_transaction_from_wait(op);
+	return FALSE;
+}
+
+static int has_range_conflict(struct operation *op) {
+	gpointer args[2] = { op, GINT_TO_POINTER(get_transaction(op->transaction)->slot) };
+
+	return (lock_index != NULL) &&
+		(key_index_find(lock_index, op_low(op), op->high, key_conflict, args) != NULL);
+}
+
+// Conversão: pedido de U ou X de quem já tem um lock mais fraco na variável
+// (S para U, S ou U para X).
+static int is_conversion(struct operation *op) {
+	struct transaction *trans = get_transaction(op->transaction);
+
+	if (op->cmd == CMD_LOCK_X)
+		return holds_lock(lock_s_table, op->var, trans) ||
+			holds_lock(lock_u_table, op->var, trans);
+
+	if (op->cmd == CMD_LOCK_U)
+		return holds_lock(lock_s_table, op->var, trans);
+
+	return 0;
+}
+
+// As conversões esperam na frente da fila da variável, antes dos pedidos
+// novos; esta é a primeira delas de outra transação, se houver.
+static struct operation *queued_conversion(struct operation *op) {
+	GQueue *queue = g_hash_table_lookup(wait_table, op->var);
+
+	for (GList *l = queue ? queue->head : NULL; l != NULL; l = l->next) {
+		struct operation *waiting = l->data;
+		if (!is_conversion(waiting))
+			break;
+		if (waiting->transaction != op->transaction)
+			return waiting;
+	}
+
+	return NULL;
+}
+
+// Transações com conversões na frente de op, que um pedido novo espera.
+static GSList *collect_conversions(struct operation *op, GSList *others) {
+	GQueue *queue = g_hash_table_lookup(wait_table, op->var);
+
+	for (GList *l = queue ? queue->head : NULL; l != NULL; l = l->next) {
+		struct operation *waiting = l->data;
+		if (!is_conversion(waiting))
+			break;
+		if (waiting->transaction != op->transaction)
+			others = g_slist_prepend(others, get_transaction(waiting->transaction));
+	}
+
+	return others;
+}
+
+// Donos de outra variável sobreposta a args[0] que conflitam com ele, menos
+// a própria transação (a do slot args[2]), acumulados em args[1].
+static gboolean collect_conflict(gpointer data, gpointer user_data) {
+	gpointer *args = user_data;
+	struct indexed_key *key = data;
+	struct operation *op = args[0];
+	int n = conflicting_sets(op);
+	int self = GPOINTER_TO_INT(args[2]);
+
+	if (strcmp(key->var, op->var) == 0)
+		return FALSE;
+
+	for (int i = 0; i < n; i++) {
+		int slot = -1;
+
+		for (int left = holder_set_count(key->sets[i]); left > 0; left--) {
+			slot = holder_set_next(key->sets[i], slot + 1);
+			if (slot != self)
+				args[1] = g_slist_prepend(args[1], g_ptr_array_index(slot_table, slot));
 		}
-//		else {
-//			printf("EXWN: ");
-//			dump_operation(op);
-//		}
 	}
+
+	return FALSE;
 }
 
-void exec_waiting_operations() {
-	if (wait_table == NULL)
+// Transações das quais op, em espera, depende: donas de locks conflitantes
+// na variável (X sempre, U se op for U ou X, S se op for X), de locks de
+// intervalo sobrepostos e, para um pedido novo, de conversões na frente da
+// fila. Os donos da variável são lidos direto dos bitsets, sem alocar nada.
+static void blockers_init(struct blocker_iter *it, struct operation *op) {
+	gpointer args[3] = { op, NULL, GINT_TO_POINTER(get_transaction(op->transaction)->slot) };
+
+	it->op = op;
+	it->sets[0] = g_hash_table_lookup(lock_x_table, op->var);
+	it->sets[1] = NULL;
+	it->sets[2] = NULL;
+	if (op->cmd != CMD_LOCK_S)
+		it->sets[1] = g_hash_table_lookup(lock_u_table, op->var);
+	// Apenas um X_LOCK pode ser bloqueado por um S_LOCK
+	if (op->cmd == CMD_LOCK_X)
+		it->sets[2] = g_hash_table_lookup(lock_s_table, op->var);
+	it->set = 0;
+	it->slot = -1;
+	it->left = holder_set_count(it->sets[0]);
+
+	if (lock_index != NULL)
+		key_index_find(lock_index, op_low(op), op->high, collect_conflict, args);
+	it->others = args[1];
+	if (!is_conversion(op))
+		it->others = collect_conversions(op, it->others);
+}
+
+static struct transaction *blockers_next(struct blocker_iter *it) {
+	struct transaction *h;
+
+	while (it->set < 3) {
+		// Para no último dono, sem varrer o resto do conjunto.
+		if (it->left == 0) {
+			if (++it->set < 3)
+				it->left = holder_set_count(it->sets[it->set]);
+			it->slot = -1;
+			continue;
+		}
+
+		it->slot = holder_set_next(it->sets[it->set], it->slot + 1);
+		it->left--;
+		h = g_ptr_array_index(slot_table, it->slot);
+		if (h->id != it->op->transaction)
+			return h;
+	}
+
+	if (it->others == NULL)
+		return NULL;
+
+	h = it->others->data;
+	it->others = g_slist_delete_link(it->others, it->others);
+	return h;
+}
+
+static void blockers_clear(struct blocker_iter *it) {
+	g_slist_free(it->others);
+	it->others = NULL;
+}
+
+// Lock de intervalo da própria transação que cobre a leitura ou escrita op.
+static gboolean covering_lock(gpointer data, gpointer user_data) {
+	struct indexed_key *key = data;
+	struct operation *op = user_data;
+	struct transaction *trans = get_transaction(op->transaction);
+
+	if ((key->high == NULL) || !interval_covers(key->low, key->high, op_low(op), op->high))
+		return FALSE;
+
+	return holds_lock(lock_x_table, key->var, trans) || ((op->cmd == CMD_READ) &&
+			(holds_lock(lock_u_table, key->var, trans) ||
+			 holds_lock(lock_s_table, key->var, trans)));
+}
+
+static int holds_range(struct operation *op) {
+	return (lock_index != NULL) &&
+		(key_index_find(lock_index, op_low(op), op->high, covering_lock, op) != NULL);
+}
+
+// Relê os conjuntos de donos de var depois que um deles foi criado ou
+// descartado.
+static void refresh_key_sets(char *var) {
+	struct indexed_key *key;
+
+	if ((lock_index == NULL) || ((key = g_hash_table_lookup(lock_index->keys, var)) == NULL))
 		return;
 
-	g_hash_table_foreach(wait_table, exec_waiting_list, NULL);
-	cleanup_waiting_operations();
+	key->sets[0] = g_hash_table_lookup(lock_x_table, var);
+	key->sets[1] = g_hash_table_lookup(lock_u_table, var);
+	key->sets[2] = g_hash_table_lookup(lock_s_table, var);
+}
+
+static void index_holders(gpointer key, gpointer value, gpointer userdata) {
+	struct transaction *trans = value;
+
+	for (GSList *l = trans->locks; l != NULL; l = l->next) {
+		struct operation *held = l->data;
+		key_index_add(lock_index, held);
+		refresh_key_sets(held->var);
+	}
+}
+
+static void index_wait_queue(gpointer key, gpointer value, gpointer userdata) {
+	key_index_add(wait_index, g_queue_peek_head(value));
+}
+
+// Primeiro pedido de intervalo: indexa os locks já concedidos e as filas.
+static void build_lock_index() {
+	lock_index = key_index_new();
+	g_hash_table_foreach(transaction_table, index_holders, NULL);
+	wait_index = key_index_new();
+	g_hash_table_foreach(wait_table, index_wait_queue, NULL);
+}
+
+// Tira var do índice quando a última transação solta o lock dela.
+static void unindex_var(char *var) {
+	struct indexed_key *key;
+
+	if ((lock_index == NULL) || ((key = g_hash_table_lookup(lock_index->keys, var)) == NULL))
+		return;
+
+	if ((key->sets[0] == NULL) && (key->sets[1] == NULL) && (key->sets[2] == NULL))
+		key_index_remove(lock_index, var);
+}
+
+static gint held_var_cmp(gconstpointer held, gconstpointer var) {
+	return strcmp(((struct operation *)held)->var, var);
 }
 
-void exec_operations(GSList *op_list) {
+// Concede, na ordem de chegada, os locks em espera que ficaram compatíveis
+// em var. As transações atendidas vão para a fila de prontas.
+static void wake_waiters(char *var) {
 	struct operation *op;
+	struct transaction *trans;
+	GQueue *queue;
+	GList *l, *next;
+
+	queue = g_hash_table_lookup(wait_table, var);
+	if (queue == NULL)
+		return;
+
+	for (l = queue->head; l != NULL; l = next) {
+		next = l->next;
+		op = l->data;
+		// Vítimas já escolhidas esperam apenas o seu abort.
+		if (did_aborted(op) || (operation_status(op) != OP_OK))
+			continue;
+
+		if (tracing) {
+			fprintf(out(), "EXWO: ");
+			dump_operation(op);
+		}
+
+		trans = get_transaction(op->transaction);
+		trans->blocked = NULL;
+		blocked_count--;
+		g_queue_push_tail(ready_queue, trans);
+		g_queue_delete_link(queue, l);
+	}
+
+	if (g_queue_is_empty(queue))
+		drop_wait_queue(var);
+}
+
+// Pedidos em espera, do que bloqueou primeiro ao último.
+static gint wait_age_cmp(gconstpointer a, gconstpointer b) {
+	struct transaction *ta = get_transaction(((struct operation *)a)->transaction);
+	struct transaction *tb = get_transaction(((struct operation *)b)->transaction);
+
+	if (ta->blocked_since != tb->blocked_since)
+		return ta->blocked_since - tb->blocked_since;
+
+	return ta->id - tb->id;
+}
+
+static GQueue *key_queue(gpointer data) {
+	return g_hash_table_lookup(wait_table, ((struct indexed_key *)data)->var);
+}
+
+static gboolean collect_queue_head(gpointer data, gpointer user_data) {
+	GSList **heads = user_data;
+
+	*heads = g_slist_prepend(*heads, g_queue_peek_head(key_queue(data)));
+
+	return FALSE;
+}
+
+// Um lock liberado em var pode servir a quem espera em qualquer variável que
+// se sobreponha a [low, high).
+static void wake_overlapping(char *var, char *low, char *high) {
+	GSList *heads = NULL;
+
+	if (lock_index == NULL) {
+		wake_waiters(var);
+		return;
+	}
+
+	key_index_find(wait_index, low, high, collect_queue_head, &heads);
+
+	// As filas são atendidas pela espera mais antiga na frente delas, e não
+	// na ordem da tabela de hash, que depende do histórico.
+	heads = g_slist_sort(heads, wait_age_cmp);
+	for (GSList *l = heads; l != NULL; l = l->next)
+		wake_waiters(((struct operation *)l->data)->var);
+	g_slist_free(heads);
+}
+
+static gboolean collect_range_waiters(gpointer data, gpointer user_data) {
+	gpointer *args = user_data;
+	struct operation *op = args[0];
+
+	for (GList *l = key_queue(data)->head; l != NULL; l = l->next) {
+		struct operation *waiting = l->data;
+		if (range_conflict(op, waiting))
+			args[1] = g_slist_prepend(args[1], get_transaction(waiting->transaction));
+	}
+
+	return FALSE;
+}
+
+// Só quem espera num intervalo sobreposto a op ganhou uma aresta nova. A
+// primeira checagem que fecha um ciclo escolhe a vítima, então os suspeitos
+// vão para a fila da transação mais nova para a mais velha, como em
+// pick_victim, e não na ordem da tabela de hash, que depende do histórico.
+static void push_range_waiters(struct operation *op) {
+	gpointer args[2] = { op, NULL };
+	GSList *suspects;
+
+	key_index_find(wait_index, op_low(op), op->high, collect_range_waiters, args);
+	suspects = args[1];
+
+	suspects = g_slist_sort(suspects, trans_id_cmp);
+	suspects = g_slist_reverse(suspects);
+	for (GSList *l = suspects; l != NULL; l = l->next)
+		g_queue_push_tail(deadlock_queue, l->data);
+	g_slist_free(suspects);
+}
+
+// Um lock concedido em uma variável com fila cria arestas de espera novas
+// para quem já estava esperando nela.
+static void add_holder(GHashTable *table, struct operation *op) {
+	struct transaction *trans;
+	struct holder_set *set;
+	GQueue *queue;
+	GSList *l;
+	int created = 0;
+
+	trans = get_transaction(op->transaction);
+	take_slot(trans);
+
+	set = g_hash_table_lookup(table, op->var);
+	if (set == NULL) {
+		set = holder_set_new();
+		g_hash_table_insert(table, op->var, set);
+		created = 1;
+	}
+	holder_set_add(set, trans->slot);
+
+	// Um lock novo na mesma variável (a conversão de S para X) substitui o
+	// anterior.
+	l = g_slist_find_custom(trans->locks, op->var, held_var_cmp);
+	if (l == NULL)
+		trans->locks = g_slist_prepend(trans->locks, op);
+	else
+		l->data = op;
+
+	if (lock_index != NULL) {
+		key_index_add(lock_index, op);
+		if (created)
+			refresh_key_sets(op->var);
+	}
+
+	if (periodic_detection())
+		return;
+
+	queue = g_hash_table_lookup(wait_table, op->var);
+	for (GList *l = queue ? queue->head : NULL; l != NULL; l = l->next) {
+		struct operation *waiting = l->data;
+		if (modes_conflict(op->cmd, waiting->cmd))
+			g_queue_push_tail(deadlock_queue, get_transaction(waiting->transaction));
+	}
+
+	if (lock_index != NULL)
+		push_range_waiters(op);
+}
+
+// Tira trans do conjunto de donos de var. Retorna 1 se ela estava lá.
+static int remove_holder(GHashTable *table, char *var, struct transaction *trans) {
+	struct holder_set *set;
+
+	set = g_hash_table_lookup(table, var);
+	if ((set == NULL) || (trans->slot < 0) || !holder_set_remove(set, trans->slot))
+		return 0;
+
+	if (holder_set_count(set) == 0) {
+		g_hash_table_remove(table, var);
+		refresh_key_sets(var);
+	}
+
+	return 1;
+}
+
+static enum op_stats unlock_variable(struct operation *op) {
+	struct transaction *trans;
+	GSList *l;
+
+	if (op == NULL)
+		return OP_ERROR;
+
+	if (is_transaction_waiting(op))
+		return OP_WAIT;
+
+	trans = get_transaction(op->transaction);
+	if (!remove_holder(lock_x_table, op->var, trans) &&
+			!remove_holder(lock_u_table, op->var, trans) &&
+			!remove_holder(lock_s_table, op->var, trans))
+		return OP_ERROR;
+
+	trans->unlocked = 1;
+	unindex_var(op->var);
+	l = g_slist_find_custom(trans->locks, op->var, held_var_cmp);
+	if (l != NULL)
+		trans->locks = g_slist_delete_link(trans->locks, l);
+	drop_slot(trans);
+
+	wake_overlapping(op->var, op_low(op), op->high);
+
+	return OP_OK;
+}
+
+// Libera os locks e a espera da transação, concedendo o que ficou livre.
+static void release_transaction(struct transaction *trans) {
+	GSList *locks;
+
+	trans->aborted = 1;
+
+	if (trans->blocked != NULL) {
+		char *var = trans->blocked->var;
+		remove_transaction_from_wait(trans);
+		wake_waiters(var);
+	}
+	g_queue_clear(&trans->pending);
+
+	// Removendo das tabelas de lock_s e lock_x
+	locks = trans->locks;
+	trans->locks = NULL;
+	for (GSList *l = locks; l != NULL; l = l->next) {
+		struct operation *held = l->data;
+
+		remove_holder(lock_s_table, held->var, trans);
+		remove_holder(lock_u_table, held->var, trans);
+		remove_holder(lock_x_table, held->var, trans);
+		unindex_var(held->var);
+		wake_overlapping(held->var, op_low(held), held->high);
+	}
+	g_slist_free(locks);
+	drop_slot(trans);
+
+#ifdef DEBUG
+	dump_wait_table();
+#endif
+}
+
+static void abort_transaction(struct transaction *trans) {
+	fprintf(out(), "* ABORTING TRANSACTION: %d *\n", trans->id);
+	stats_run->aborts++;
+	release_transaction(trans);
+}
+
+static enum op_stats can_s_lock(struct operation *op) {
+	if (did_unlocked(op))
+		return OP_ERROR;
+
+	// Quem já tem o X não precisa de mais nada.
+	if (holds_lock(lock_x_table, op->var, get_transaction(op->transaction)))
+		return OP_OK;
+
+	// Checando se a variável já foi bloqueada exclusivamente por alguma
+	// transição.
+	if (g_hash_table_lookup(lock_x_table, op->var) != NULL)
+		return OP_WAIT;
+
+	if (has_range_conflict(op))
+		return OP_WAIT;
+
+	// Um pedido novo não passa na frente de uma conversão em espera.
+	if (queued_conversion(op) != NULL)
+		return OP_WAIT;
+
+	return OP_OK;
+}
+
+static enum op_stats can_u_lock(struct operation *op) {
+	struct transaction *trans;
+
+	if (did_unlocked(op))
+		return OP_ERROR;
+
+	// Quem já tem o X não precisa de mais nada.
+	trans = get_transaction(op->transaction);
+	if (holds_lock(lock_x_table, op->var, trans))
+		return OP_OK;
+
+	// Só um U por vez, e nenhum X de outra transação.
+	if (holder_set_has_other(g_hash_table_lookup(lock_x_table, op->var), trans->slot) ||
+			holder_set_has_other(g_hash_table_lookup(lock_u_table, op->var), trans->slot))
+		return OP_WAIT;
+
+	if (has_range_conflict(op))
+		return OP_WAIT;
+
+	if (!is_conversion(op) && (queued_conversion(op) != NULL))
+		return OP_WAIT;
+
+	return OP_OK;
+}
+
+static enum op_stats can_x_lock(struct operation *op) {
+	int slot;
+
+	if (did_unlocked(op))
+		return OP_ERROR;
+
+	slot = get_transaction(op->transaction)->slot;
+
+	// Checando se a variável já foi bloqueada, exclusivamente ou de maneira
+	// compartilhada, por alguma outra transição.
+	if (holder_set_has_other(g_hash_table_lookup(lock_x_table, op->var), slot) ||
+			holder_set_has_other(g_hash_table_lookup(lock_u_table, op->var), slot) ||
+			holder_set_has_other(g_hash_table_lookup(lock_s_table, op->var), slot))
+		return OP_WAIT;
+
+	// Locks de intervalo sobrepostos.
+	if (has_range_conflict(op))
+		return OP_WAIT;
+
+	if (!is_conversion(op) && (queued_conversion(op) != NULL))
+		return OP_WAIT;
+
+	return OP_OK;
+}
+
+static enum op_stats can_write(struct operation *op) {
+	if (op == NULL) {
+		return OP_ERROR;
+	}
+
+	if (is_transaction_waiting(op))
+		return OP_WAIT;
+
+	// Checando se a variável já foi bloqueada exclusivamente pela transição.
+	if (holds_lock(lock_x_table, op->var, get_transaction(op->transaction)))
+		return OP_OK;
+
+	// Ou coberta por um lock de intervalo da transação.
+	if (holds_range(op))
+		return OP_OK;
+
+	return OP_ERROR;
+}
+
+static enum op_stats can_read(struct operation *op) {
 	enum op_stats stats;
 
-	if (op_list == NULL)
+	if (op == NULL)
+		return OP_ERROR;
+
+	stats = can_write(op);
+
+	if (stats == OP_OK)
+		return OP_OK;
+	else if (stats == OP_WAIT)
+		return OP_WAIT;
+
+	// Checando se a variável já foi bloqueada de maneira compartilhada
+	// (ou para atualização) pela transição.
+	if (holds_lock(lock_s_table, op->var, get_transaction(op->transaction)) ||
+			holds_lock(lock_u_table, op->var, get_transaction(op->transaction)))
+		return OP_OK;
+
+	// Ou coberta por um lock de intervalo da transação.
+	if (holds_range(op))
+		return OP_OK;
+
+	return OP_ERROR;
+}
+
+static void s_lock(struct operation *op) {
+	struct transaction *trans = get_transaction(op->transaction);
+
+	// Um U ou um X já concedido cobre as leituras.
+	if (!holds_lock(lock_u_table, op->var, trans) &&
+			!holds_lock(lock_x_table, op->var, trans))
+		add_holder(lock_s_table, op);
+}
+
+static void u_lock(struct operation *op) {
+	struct transaction *trans = get_transaction(op->transaction);
+
+	if (holds_lock(lock_x_table, op->var, trans))
 		return;
 
-	lock_s_table = g_hash_table_new(g_str_hash, g_str_equal);
-	lock_x_table = g_hash_table_new(g_str_hash, g_str_equal);
-	wait_table = g_hash_table_new(g_str_hash, g_str_equal);
-	aborted_transaction_list = NULL;
-
-	int i = 0;
-	while ((i < g_slist_length(op_list)) || (g_hash_table_size(wait_table) > 0)) {
-		exec_waiting_operations();
-		if (i < g_slist_length(op_list)) {
-			op = g_slist_nth_data(op_list, i);
-			if (did_aborted(op)) {
-				i++;
-				continue;
-			}
-			printf("EXEC: ");
+	remove_holder(lock_s_table, op->var, trans);
+	add_holder(lock_u_table, op);
+}
+
+static void x_lock(struct operation *op) {
+	struct transaction *trans = get_transaction(op->transaction);
+
+	remove_holder(lock_s_table, op->var, trans);
+	remove_holder(lock_u_table, op->var, trans);
+	add_holder(lock_x_table, op);
+}
+
+static enum op_stats operation_status(struct operation *op) {
+	enum op_stats stats;
+
+	if (op == NULL)
+		return OP_UNKNOWN;
+
+	if ((op->high != NULL) && (lock_index == NULL))
+		build_lock_index();
+
+	switch (op->cmd) {
+		case CMD_WRITE:
+			return can_write(op);
+		case CMD_READ:
+			return can_read(op);
+		case CMD_LOCK_S:
+			stats = can_s_lock(op);
+			if (stats == OP_OK)
+				s_lock(op);
+			return stats;
+		case CMD_LOCK_U:
+			stats = can_u_lock(op);
+			if (stats == OP_OK)
+				u_lock(op);
+			return stats;
+		case CMD_LOCK_X:
+			stats = can_x_lock(op);
+			if (stats == OP_OK)
+				x_lock(op);
+			return stats;
+		case CMD_UNLOCK:
+			return unlock_variable(op);
+		case CMD_UNKNOWN:
+		default:
+			break;
+	}
+
+
+	return OP_ERROR;
+}
+
+static void exec_transaction_operation(struct transaction *trans, struct operation *op) {
+	enum op_stats stats;
+
+	stats = operation_status(op);
+	if (stats == OP_WAIT)
+		add_transaction_to_wait(trans, op);
+	else if (stats != OP_OK) {
+		fprintf(out(), "ERROR: ");
+		dump_operation(op);
+		abort_transaction(trans);
+	}
+}
+
+// Uma transação liberada executa as operações que enfileirou enquanto
+// esperava, até terminar ou bloquear de novo.
+static void exec_ready_transaction(struct transaction *trans) {
+	struct operation *op;
+
+	while (!trans->aborted && (trans->blocked == NULL) &&
+			!g_queue_is_empty(&trans->pending)) {
+		op = g_queue_pop_head(&trans->pending);
+		if (tracing) {
+			fprintf(out(), "EXWO: ");
 			dump_operation(op);
-			stats = operation_status(op);
-			if (stats == OP_WAIT)
-				add_transaction_to_wait(op);
-			else if (stats != OP_OK) {
-				printf("ERROR: ");
-				dump_operation(op);
-				abort_transaction(op);
-			}
-			i++;
 		}
-		check_deadlocks();
+		exec_transaction_operation(trans, op);
+	}
+}
+
+static void submit_operation(struct operation *op) {
+	struct transaction *trans;
+
+	if (did_aborted(op))
+		return;
+
+	if (tracing) {
+		fprintf(out(), "EXEC: ");
+		dump_operation(op);
+	}
+	stats_run->operations++;
+
+	trans = get_transaction(op->transaction);
+	if (trans->blocked != NULL) {
 #ifdef DEBUG
-		dump_wait_table();
-		dump_lock_x_table();
-		dump_lock_s_table();
+		fprintf(out(), "ADDING TO WAIT: ");
+		dump_operation(op);
 #endif
+		g_queue_push_tail(&trans->pending, op);
+		return;
 	}
 
+	exec_transaction_operation(trans, op);
+}
+
+static void free_wait_queue(gpointer data) {
+	g_queue_free(data);
+}
+
+static void free_holder_set(gpointer data) {
+	holder_set_free(data);
+}
+
+static int count_holders(GHashTable *table) {
+	GHashTableIter iter;
+	gpointer set;
+	int n = 0;
+
+	g_hash_table_iter_init(&iter, table);
+	while (g_hash_table_iter_next(&iter, NULL, &set))
+		n += holder_set_count(set);
+
+	return n;
+}
+
+static int count_waits() {
+	GHashTableIter iter;
+	gpointer queue;
+	int n = 0;
+
+	g_hash_table_iter_init(&iter, wait_table);
+	while (g_hash_table_iter_next(&iter, NULL, &queue))
+		n += g_queue_get_length(queue);
+
+	return n;
+}
+
+void lock_manager_init(struct exec_stats *run) {
+	memset(run, 0, sizeof(struct exec_stats));
+	stats_run = run;
+	tracing = 0;
+	detect_timer = g_timer_new();
+	g_timer_stop(detect_timer);
+	step = 0;
+	blocked_count = 0;
+	last_detection = 0;
+	schedule_hash = 0;
+
+	transaction_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, free_transaction);
+	lock_s_table = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_holder_set);
+	lock_u_table = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_holder_set);
+	lock_x_table = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_holder_set);
+	slot_table = g_ptr_array_new();
+	free_slots = g_array_new(FALSE, FALSE, sizeof(int));
+	wait_table = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_wait_queue);
+	ready_queue = g_queue_new();
+	deadlock_queue = g_queue_new();
+	blocked_queue = g_queue_new();
+	lock_index = NULL;
+	wait_index = NULL;
+}
+
+// Retorna 1 se sobraram locks ou esperas nas tabelas.
+int lock_manager_free() {
+	int leftover;
+
 #ifdef DEBUG
+	dump_lock_u_table();
 	dump_lock_s_table();
 	dump_lock_x_table();
 	dump_wait_table();
@@ -733,14 +1545,707 @@ void exec_operations(GSList *op_list) {
 	dump_aborted_list();
 #endif
 
-	if ((g_hash_table_size(lock_x_table) > 0) ||
+	leftover = (g_hash_table_size(lock_x_table) > 0) ||
+			(g_hash_table_size(lock_u_table) > 0) ||
 			(g_hash_table_size(lock_s_table) > 0) ||
-			(g_hash_table_size(wait_table) > 0))
-		printf("ERROR!\n");
+			(g_hash_table_size(wait_table) > 0);
 
+	key_index_free(lock_index);
+	lock_index = NULL;
+	key_index_free(wait_index);
+	wait_index = NULL;
 	g_hash_table_destroy(lock_s_table);
+	g_hash_table_destroy(lock_u_table);
 	g_hash_table_destroy(lock_x_table);
 	g_hash_table_destroy(wait_table);
-	g_slist_free(unlocked_transaction_list);
-	g_slist_free(aborted_transaction_list);
+	g_hash_table_destroy(transaction_table);
+	g_ptr_array_free(slot_table, TRUE);
+	g_array_free(free_slots, TRUE);
+	g_queue_free(ready_queue);
+	g_queue_free(deadlock_queue);
+	g_queue_free_full(blocked_queue, g_free);
+	g_timer_destroy(detect_timer);
+
+	return leftover;
+}
+
+// Pedido isolado a esta instância: concede, enfileira (OP_WAIT) ou recusa.
+// Quem chama decide o que fazer com erros e deadlocks; as transações com
+// arestas de espera novas saem por lock_manager_next_suspect().
+enum op_stats lock_manager_request(struct operation *op) {
+	enum op_stats stats;
+
+	stats = operation_status(op);
+	if (stats == OP_WAIT)
+		add_transaction_to_wait(get_transaction(op->transaction), op);
+
+	return stats;
+}
+
+// Próxima transação que teve seu lock concedido por um unlock ou abort.
+int lock_manager_next_grant(int *transaction) {
+	struct transaction *trans;
+
+	trans = g_queue_pop_head(ready_queue);
+	if (trans == NULL)
+		return 0;
+
+	*transaction = trans->id;
+	return 1;
+}
+
+// Próxima transação que ganhou uma aresta de espera nova nesta instância e
+// ainda está bloqueada.
+int lock_manager_next_suspect(int *transaction) {
+	struct transaction *trans;
+
+	while ((trans = g_queue_pop_head(deadlock_queue)) != NULL) {
+		if (!trans->aborted && (trans->blocked != NULL)) {
+			*transaction = trans->id;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void lock_manager_abort(int transaction) {
+	struct transaction *trans;
+
+	trans = get_transaction(transaction);
+	release_transaction(trans);
+}
+
+int lock_manager_is_blocked(int transaction) {
+	struct transaction *trans;
+
+	trans = g_hash_table_lookup(transaction_table, GINT_TO_POINTER(transaction));
+	return (trans != NULL) && (trans->blocked != NULL);
+}
+
+// Se transaction está bloqueada num ciclo do grafo de espera desta
+// instância.
+int lock_manager_in_cycle(int transaction) {
+	struct transaction *trans;
+	GHashTable *visited;
+	int found;
+
+	trans = g_hash_table_lookup(transaction_table, GINT_TO_POINTER(transaction));
+	if ((trans == NULL) || (trans->blocked == NULL))
+		return 0;
+
+	visited = g_hash_table_new(g_direct_hash, g_direct_equal);
+	found = waits_for(trans, trans, visited);
+	g_hash_table_destroy(visited);
+
+	return found;
+}
+
+int lock_manager_holds_locks(int transaction) {
+	struct transaction *trans;
+
+	trans = g_hash_table_lookup(transaction_table, GINT_TO_POINTER(transaction));
+	return (trans != NULL) && (trans->locks != NULL);
+}
+
+// Esquece uma transação que não tem locks nem espera, para que o id possa
+// ser usado de novo.
+void lock_manager_forget(int transaction) {
+	struct transaction *trans;
+
+	trans = g_hash_table_lookup(transaction_table, GINT_TO_POINTER(transaction));
+	if ((trans == NULL) || (trans->locks != NULL) || (trans->blocked != NULL))
+		return;
+
+	g_queue_remove_all(ready_queue, trans);
+	g_queue_remove_all(deadlock_queue, trans);
+	g_hash_table_remove(transaction_table, GINT_TO_POINTER(transaction));
+}
+
+// Transações das quais transaction espera nesta instância.
+GSList *lock_manager_waits_for(int transaction) {
+	struct transaction *trans, *h;
+	struct blocker_iter it;
+	GSList *list = NULL;
+
+	trans = g_hash_table_lookup(transaction_table, GINT_TO_POINTER(transaction));
+	if ((trans == NULL) || (trans->blocked == NULL))
+		return NULL;
+
+	blockers_init(&it, trans->blocked);
+	while ((h = blockers_next(&it)) != NULL)
+		list = g_slist_prepend(list, GINT_TO_POINTER(h->id));
+	blockers_clear(&it);
+
+	return list;
+}
+
+// FNV-1a sobre transação, comando e variável.
+static guint64 hash_operation(guint64 hash, struct operation *op) {
+	const guint64 prime = 1099511628211ULL;
+
+	hash = (hash ^ (guint32)op->transaction) * prime;
+	hash = (hash ^ op->cmd) * prime;
+	for (char *c = op->var; *c != '\0'; c++)
+		hash = (hash ^ (guchar)*c) * prime;
+
+	return hash;
+}
+
+// Checkpoints
+//
+// As operações guardadas no estado (pedidos em espera, enfileirados e os
+// que obtiveram locks) são gravadas pela sua posição na escala, que o
+// resume lê de novo; o resto do arquivo as cita pelo índice nessa lista.
+// Os donos de cada lock saem dos locks de cada transação: o comando do
+// pedido que obteve o lock diz a tabela.
+
+static gint seq_cmp(gconstpointer a, gconstpointer b) {
+	return (*(struct operation **)a)->seq - (*(struct operation **)b)->seq;
+}
+
+static void collect_state_ops(gpointer key, gpointer value, gpointer userdata) {
+	struct transaction *trans = value;
+	GPtrArray *ops = userdata;
+
+	if (trans->blocked != NULL)
+		g_ptr_array_add(ops, trans->blocked);
+	for (GList *l = trans->pending.head; l != NULL; l = l->next)
+		g_ptr_array_add(ops, l->data);
+	for (GSList *l = trans->locks; l != NULL; l = l->next)
+		g_ptr_array_add(ops, l->data);
+}
+
+static void put_ref(GByteArray *buf, GHashTable *refs, struct operation *op) {
+	if (op == NULL)
+		checkpoint_put(buf, -1);
+	else
+		checkpoint_put(buf, GPOINTER_TO_INT(g_hash_table_lookup(refs, op)));
+}
+
+static void put_transaction_ids(GByteArray *buf, GQueue *queue) {
+	checkpoint_put(buf, g_queue_get_length(queue));
+	for (GList *l = queue->head; l != NULL; l = l->next)
+		checkpoint_put(buf, ((struct transaction *)l->data)->id);
+}
+
+// Grava o estado do fim do passo corrente, com cursor operações da escala
+// já consumidas.
+static void save_checkpoint(int cursor) {
+	GHashTableIter iter;
+	gpointer value;
+	GHashTable *refs;
+	GPtrArray *ops;
+	GByteArray *buf;
+	int prev = 0, n = 0;
+
+	ops = g_ptr_array_new();
+	g_hash_table_foreach(transaction_table, collect_state_ops, ops);
+	g_ptr_array_sort(ops, seq_cmp);
+
+	buf = checkpoint_new();
+	checkpoint_put(buf, detect_policy.interval);
+	checkpoint_put(buf, detect_policy.blocked);
+	checkpoint_put(buf, detect_policy.waited);
+	checkpoint_put(buf, cursor);
+	checkpoint_put(buf, (gint64)schedule_hash);
+
+	checkpoint_put(buf, step);
+	checkpoint_put(buf, blocked_count);
+	checkpoint_put(buf, last_detection);
+	checkpoint_put(buf, lock_index != NULL);
+	checkpoint_put(buf, stats_run->operations);
+	checkpoint_put(buf, stats_run->waits);
+	checkpoint_put(buf, stats_run->upgrade_waits);
+	checkpoint_put(buf, stats_run->deadlocks);
+	checkpoint_put(buf, stats_run->aborts);
+	checkpoint_put(buf, stats_run->detections);
+	checkpoint_put(buf, stats_run->deadlock_delay);
+	checkpoint_put(buf, 1e6 * (stats_run->detect_time +
+				g_timer_elapsed(detect_timer, NULL)));
+
+	// Posições crescentes, gravadas como diferenças.
+	refs = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for (int i = 0; i < ops->len; i++) {
+		struct operation *op = g_ptr_array_index(ops, i);
+		if (!g_hash_table_contains(refs, op))
+			g_hash_table_insert(refs, op, GINT_TO_POINTER(n++));
+	}
+	checkpoint_put(buf, n);
+	for (int i = 0; i < ops->len; i++) {
+		struct operation *op = g_ptr_array_index(ops, i);
+		if ((i > 0) && (op == g_ptr_array_index(ops, i - 1)))
+			continue;
+		checkpoint_put(buf, op->seq - prev);
+		prev = op->seq;
+	}
+
+	checkpoint_put(buf, slot_table->len);
+	checkpoint_put(buf, free_slots->len);
+	for (int i = 0; i < free_slots->len; i++)
+		checkpoint_put(buf, g_array_index(free_slots, int, i));
+
+	checkpoint_put(buf, g_hash_table_size(transaction_table));
+	g_hash_table_iter_init(&iter, transaction_table);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct transaction *trans = value;
+
+		checkpoint_put(buf, trans->id);
+		checkpoint_put(buf, trans->unlocked | (trans->aborted << 1));
+		checkpoint_put(buf, trans->slot);
+		checkpoint_put(buf, trans->blocked_since);
+		put_ref(buf, refs, trans->blocked);
+		checkpoint_put(buf, g_queue_get_length(&trans->pending));
+		for (GList *l = trans->pending.head; l != NULL; l = l->next)
+			put_ref(buf, refs, l->data);
+		checkpoint_put(buf, g_slist_length(trans->locks));
+		for (GSList *l = trans->locks; l != NULL; l = l->next)
+			put_ref(buf, refs, l->data);
+	}
+
+	checkpoint_put(buf, g_hash_table_size(wait_table));
+	g_hash_table_iter_init(&iter, wait_table);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		GQueue *queue = value;
+		checkpoint_put(buf, g_queue_get_length(queue));
+		for (GList *l = queue->head; l != NULL; l = l->next)
+			put_ref(buf, refs, l->data);
+	}
+
+	put_transaction_ids(buf, ready_queue);
+	put_transaction_ids(buf, deadlock_queue);
+	checkpoint_put(buf, g_queue_get_length(blocked_queue));
+	for (GList *l = blocked_queue->head; l != NULL; l = l->next) {
+		struct wait_entry *entry = l->data;
+		checkpoint_put(buf, entry->trans->id);
+		checkpoint_put(buf, entry->since);
+	}
+
+	if (checkpoint_write(checkpoint_policy.path, buf) == 0)
+		fprintf(out(), "* CHECKPOINT AT OPERATION %d: %u bytes *\n", cursor, buf->len);
+
+	g_byte_array_free(buf, TRUE);
+	g_hash_table_destroy(refs);
+	g_ptr_array_free(ops, TRUE);
+}
+
+// Operação citada pelo índice ref; -1 é nenhuma.
+static struct operation *get_ref(struct checkpoint_reader *reader,
+		struct operation **refs, int nrefs) {
+	gint64 ref = checkpoint_get(reader);
+
+	if ((ref < -1) || (ref >= nrefs)) {
+		reader->error = 1;
+		return NULL;
+	}
+
+	return (ref < 0) ? NULL : refs[ref];
+}
+
+// Operação de trans citada pelo checkpoint; -1 só vale se optional.
+static struct operation *get_own_ref(struct checkpoint_reader *reader,
+		struct operation **refs, int nrefs, struct transaction *trans, int optional) {
+	struct operation *op = get_ref(reader, refs, nrefs);
+
+	if ((op == NULL) ? !optional : (op->transaction != trans->id))
+		reader->error = 1;
+
+	return reader->error ? NULL : op;
+}
+
+// Todas as transações vão para o checkpoint antes das filas que as citam.
+static struct transaction *get_ref_transaction(struct checkpoint_reader *reader) {
+	gint64 id = checkpoint_get(reader);
+	struct transaction *trans;
+
+	trans = g_hash_table_lookup(transaction_table, GINT_TO_POINTER(id));
+	if ((trans == NULL) || (id != (int)id))
+		reader->error = 1;
+
+	return reader->error ? NULL : trans;
+}
+
+// Número de itens que ainda cabem no arquivo, pelo menos um byte cada.
+static int get_count(struct checkpoint_reader *reader) {
+	gint64 n = checkpoint_get(reader);
+
+	if ((n < 0) || (n > reader->size - reader->pos))
+		reader->error = 1;
+
+	return reader->error ? 0 : n;
+}
+
+// Relê as primeiras cursor operações da escala, numerando-as, e guarda as
+// nrefs citadas pelo checkpoint. Retorna o resto da escala em *next.
+static struct operation **find_refs(struct checkpoint_reader *reader, GSList *op_list,
+		int cursor, int nrefs, GSList **next) {
+	struct operation **refs;
+	int *seqs;
+	GSList *l = op_list;
+	int i, j = 0;
+
+	seqs = g_new(int, MAX(nrefs, 1));
+	for (i = 0; i < nrefs; i++)
+		seqs[i] = (i > 0 ? seqs[i - 1] : 0) + checkpoint_get(reader);
+
+	refs = g_new0(struct operation *, MAX(nrefs, 1));
+	for (i = 0; (i < cursor) && (l != NULL); i++, l = l->next) {
+		struct operation *op = l->data;
+
+		op->seq = i;
+		schedule_hash = hash_operation(schedule_hash, op);
+		while ((j < nrefs) && (seqs[j] == i))
+			refs[j++] = op;
+	}
+
+	if ((i < cursor) || (j < nrefs))
+		reader->error = 1;
+
+	*next = l;
+	g_free(seqs);
+
+	return refs;
+}
+
+static GHashTable *lock_table_for(enum command cmd) {
+	switch (cmd) {
+		case CMD_LOCK_S:
+			return lock_s_table;
+		case CMD_LOCK_U:
+			return lock_u_table;
+		case CMD_LOCK_X:
+			return lock_x_table;
+		default:
+			return NULL;
+	}
+}
+
+static void load_transaction(struct checkpoint_reader *reader, struct operation **refs,
+		int nrefs) {
+	struct transaction *trans;
+	struct holder_set *set;
+	GHashTable *table;
+	gint64 id, slot;
+	int flags, n;
+
+	// Cada id uma vez só.
+	id = checkpoint_get(reader);
+	if (reader->error || (id != (int)id) ||
+			g_hash_table_contains(transaction_table, GINT_TO_POINTER(id))) {
+		reader->error = 1;
+		return;
+	}
+	trans = get_transaction(id);
+
+	flags = checkpoint_get(reader);
+	trans->unlocked = flags & 1;
+	trans->aborted = (flags >> 1) & 1;
+
+	// Um slot é de uma transação só.
+	slot = checkpoint_get(reader);
+	if ((slot < -1) || (slot >= (gint64)slot_table->len) ||
+			((slot >= 0) && (g_ptr_array_index(slot_table, slot) != NULL))) {
+		reader->error = 1;
+		return;
+	}
+	trans->slot = slot;
+	if (trans->slot >= 0)
+		g_ptr_array_index(slot_table, trans->slot) = trans;
+	trans->blocked_since = checkpoint_get(reader);
+	trans->blocked = get_own_ref(reader, refs, nrefs, trans, 1);
+
+	n = get_count(reader);
+	for (int i = 0; (i < n) && !reader->error; i++) {
+		struct operation *op = get_own_ref(reader, refs, nrefs, trans, 0);
+		if (op != NULL)
+			g_queue_push_tail(&trans->pending, op);
+	}
+
+	n = get_count(reader);
+	for (int i = 0; (i < n) && !reader->error; i++) {
+		struct operation *held = get_own_ref(reader, refs, nrefs, trans, 0);
+
+		table = (held != NULL) ? lock_table_for(held->cmd) : NULL;
+		if ((table == NULL) || (trans->slot < 0)) {
+			reader->error = 1;
+			break;
+		}
+
+		set = g_hash_table_lookup(table, held->var);
+		if (set == NULL) {
+			set = holder_set_new();
+			g_hash_table_insert(table, held->var, set);
+		}
+		holder_set_add(set, trans->slot);
+		trans->locks = g_slist_prepend(trans->locks, held);
+	}
+	trans->locks = g_slist_reverse(trans->locks);
+}
+
+static int count_blocked() {
+	GHashTableIter iter;
+	gpointer value;
+	int n = 0;
+
+	g_hash_table_iter_init(&iter, transaction_table);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		n += (((struct transaction *)value)->blocked != NULL);
+
+	return n;
+}
+
+static void load_transaction_ids(struct checkpoint_reader *reader, GQueue *queue) {
+	int n = get_count(reader);
+
+	for (int i = 0; (i < n) && !reader->error; i++) {
+		struct transaction *trans = get_ref_transaction(reader);
+		if (trans != NULL)
+			g_queue_push_tail(queue, trans);
+	}
+}
+
+// Refaz o estado gravado por save_checkpoint sobre um gerenciador recém
+// criado. Retorna o cursor, com o resto da escala em *next, ou -1.
+static int load_checkpoint(struct checkpoint_reader *reader, GSList *op_list,
+		GSList **next) {
+	struct detect_policy policy;
+	struct operation **refs;
+	guint64 hash;
+	int cursor, indexed, nrefs, waiting, n;
+	guint8 *seen;
+
+	policy.interval = checkpoint_get(reader);
+	policy.blocked = checkpoint_get(reader);
+	policy.waited = checkpoint_get(reader);
+	if ((policy.interval != detect_policy.interval) ||
+			(policy.blocked != detect_policy.blocked) ||
+			(policy.waited != detect_policy.waited)) {
+		printf("The checkpoint was taken with another deadlock detection policy.\n");
+		return -1;
+	}
+
+	cursor = checkpoint_get(reader);
+	hash = checkpoint_get(reader);
+
+	step = checkpoint_get(reader);
+	blocked_count = checkpoint_get(reader);
+	last_detection = checkpoint_get(reader);
+	indexed = checkpoint_get(reader);
+	stats_run->operations = checkpoint_get(reader);
+	stats_run->waits = checkpoint_get(reader);
+	stats_run->upgrade_waits = checkpoint_get(reader);
+	stats_run->deadlocks = checkpoint_get(reader);
+	stats_run->aborts = checkpoint_get(reader);
+	stats_run->detections = checkpoint_get(reader);
+	stats_run->deadlock_delay = checkpoint_get(reader);
+	stats_run->detect_time = checkpoint_get(reader) / 1e6;
+
+	nrefs = get_count(reader);
+	if (reader->error || (cursor < 0)) {
+		printf("Corrupt checkpoint.\n");
+		return -1;
+	}
+
+	refs = find_refs(reader, op_list, cursor, nrefs, next);
+	if (reader->error || (schedule_hash != hash)) {
+		printf("The checkpoint was taken over another schedule.\n");
+		g_free(refs);
+		return -1;
+	}
+
+	g_ptr_array_set_size(slot_table, get_count(reader));
+	n = get_count(reader);
+	for (int i = 0; (i < n) && !reader->error; i++) {
+		gint64 slot = checkpoint_get(reader);
+		int free_slot = slot;
+
+		if ((slot < 0) || (slot >= (gint64)slot_table->len)) {
+			reader->error = 1;
+			break;
+		}
+		g_array_append_val(free_slots, free_slot);
+	}
+
+	n = get_count(reader);
+	for (int i = 0; (i < n) && !reader->error; i++)
+		load_transaction(reader, refs, nrefs);
+
+	// Um slot livre não pode ter dono nem aparecer duas vezes: take_slot
+	// escreveria em cima da transação que o usa.
+	seen = g_new0(guint8, MAX(slot_table->len, 1));
+	for (int i = 0; (i < free_slots->len) && !reader->error; i++) {
+		int slot = g_array_index(free_slots, int, i);
+		if ((g_ptr_array_index(slot_table, slot) != NULL) || seen[slot])
+			reader->error = 1;
+		seen[slot] = 1;
+	}
+	g_free(seen);
+
+	// Cada pedido em espera é o bloqueio da sua transação, na fila da sua
+	// variável, e elas são as blocked_count transações bloqueadas.
+	waiting = 0;
+	n = get_count(reader);
+	for (int i = 0; (i < n) && !reader->error; i++) {
+		int length = get_count(reader);
+		GQueue *queue = g_queue_new();
+
+		for (int j = 0; (j < length) && !reader->error; j++) {
+			struct operation *op = get_ref(reader, refs, nrefs);
+			struct transaction *trans = (op != NULL) ? g_hash_table_lookup(transaction_table,
+					GINT_TO_POINTER(op->transaction)) : NULL;
+
+			if ((trans == NULL) || (trans->blocked != op) || (!g_queue_is_empty(queue) &&
+						(strcmp(op->var, ((struct operation *)queue->head->data)->var) != 0)))
+				reader->error = 1;
+			else
+				g_queue_push_tail(queue, op);
+		}
+
+		if (g_queue_is_empty(queue) ||
+				g_hash_table_contains(wait_table, ((struct operation *)queue->head->data)->var)) {
+			reader->error = 1;
+			g_queue_free(queue);
+		}
+		else {
+			g_hash_table_insert(wait_table, ((struct operation *)queue->head->data)->var, queue);
+			waiting += g_queue_get_length(queue);
+		}
+	}
+	if ((waiting != blocked_count) || (count_blocked() != blocked_count))
+		reader->error = 1;
+
+	load_transaction_ids(reader, ready_queue);
+	load_transaction_ids(reader, deadlock_queue);
+	n = get_count(reader);
+	for (int i = 0; (i < n) && !reader->error; i++) {
+		struct wait_entry *entry = g_new(struct wait_entry, 1);
+		entry->trans = get_ref_transaction(reader);
+		entry->since = checkpoint_get(reader);
+		if (entry->trans == NULL)
+			g_free(entry);
+		else
+			g_queue_push_tail(blocked_queue, entry);
+	}
+	g_free(refs);
+
+	if (reader->error) {
+		printf("Corrupt checkpoint.\n");
+		return -1;
+	}
+
+	if (indexed)
+		build_lock_index();
+
+	return cursor;
+}
+
+// Laço de eventos: cada passo ou executa uma transação liberada por um grant
+// ou consome a próxima operação da escala, a de posição cursor. A detecção
+// de deadlocks roda conforme detect_policy, e os checkpoints conforme
+// checkpoint_policy.
+static void run_schedule(GSList *next, int cursor) {
+	int next_checkpoint = cursor + checkpoint_policy.every;
+
+	for (;;) {
+		step++;
+		if (!g_queue_is_empty(ready_queue)) {
+			exec_ready_transaction(g_queue_pop_head(ready_queue));
+		}
+		else if (next != NULL) {
+			struct operation *op = next->data;
+
+			op->seq = cursor++;
+			if (checkpoint_policy.path != NULL)
+				schedule_hash = hash_operation(schedule_hash, op);
+			submit_operation(op);
+			next = next->next;
+		}
+		// Fim da escala: uma última detecção antes de desistir dos bloqueados.
+		else if ((blocked_count == 0) || !periodic_detection() ||
+				(detect_deadlocks() == 0)) {
+			break;
+		}
+
+		if (should_detect())
+			detect_deadlocks();
+#ifdef DEBUG
+		dump_wait_table();
+		dump_lock_x_table();
+		dump_lock_u_table();
+		dump_lock_s_table();
+#endif
+
+		if ((checkpoint_policy.path != NULL) && (checkpoint_requested ||
+					(checkpoint_policy.every && (cursor >= next_checkpoint)))) {
+			checkpoint_requested = 0;
+			save_checkpoint(cursor);
+			next_checkpoint = cursor + checkpoint_policy.every;
+		}
+	}
+}
+
+static void finish_schedule(struct exec_stats *run, GTimer *timer) {
+	g_timer_stop(timer);
+	run->elapsed = g_timer_elapsed(timer, NULL);
+	run->transactions = g_hash_table_size(transaction_table);
+	run->committed = run->transactions - run->aborts;
+	run->detect_time += g_timer_elapsed(detect_timer, NULL);
+	run->locks_s_left = count_holders(lock_s_table);
+	run->locks_u_left = count_holders(lock_u_table);
+	run->locks_x_left = count_holders(lock_x_table);
+	run->waits_left = count_waits();
+	g_timer_destroy(timer);
+
+	if (lock_manager_free())
+		fprintf(out(), "ERROR!\n");
+}
+
+void exec_operations(GSList *op_list, struct exec_stats *run) {
+	GTimer *timer;
+
+	if ((op_list == NULL) || (run == NULL))
+		return;
+
+	lock_manager_init(run);
+	tracing = verbose;
+	timer = g_timer_new();
+
+	run_schedule(op_list, 0);
+	finish_schedule(run, timer);
+}
+
+// O resume relê a escala só até o cursor, sem executar nada; o resto do
+// tempo é proporcional ao tamanho do checkpoint.
+int exec_operations_resume(GSList *op_list, char *path, struct exec_stats *run) {
+	struct checkpoint_reader reader;
+	GSList *next = NULL;
+	GTimer *timer;
+	int cursor;
+
+	if ((op_list == NULL) || (run == NULL))
+		return -1;
+
+	if (checkpoint_open(path, &reader) < 0) {
+		printf("Cannot read checkpoint \"%s\" (missing, another version or corrupt).\n",
+				path);
+		return -1;
+	}
+
+	lock_manager_init(run);
+	tracing = verbose;
+	timer = g_timer_new();
+
+	cursor = load_checkpoint(&reader, op_list, &next);
+	checkpoint_close(&reader);
+	if (cursor < 0) {
+		g_timer_destroy(timer);
+		lock_manager_free();
+		return -1;
+	}
+
+	fprintf(out(), "Resuming at operation %d (step %d)\n", cursor, step);
+	run_schedule(next, cursor);
+	finish_schedule(run, timer);
+
+	return 0;
 }
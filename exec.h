@@ -1,9 +1,47 @@
 #ifndef _EXEC_
 #define _EXEC_
 
+#include <stdio.h>
+#include <signal.h>
 #include <glib.h>
 
-void exec_operations(GSList *op_list);
+#include "structs.h"
+
+enum op_stats
+{
+	OP_ERROR = 0,
+	OP_WAIT,
+	OP_OK,
+	OP_UNKNOWN
+};
+
+extern int verbose;
+extern struct detect_policy detect_policy;
+extern struct checkpoint_policy checkpoint_policy;
+// Pede um checkpoint no fim do passo corrente; pode ser ligado por um
+// tratador de sinal.
+extern volatile sig_atomic_t checkpoint_requested;
+
+void exec_operations(GSList *op_list, struct exec_stats *run);
+// Retoma exec_operations do checkpoint em path, tirado sobre a mesma escala
+// op_list. Retorna -1 se o checkpoint não serve para ela.
+int exec_operations_resume(GSList *op_list, char *path, struct exec_stats *run);
 void dump_operation(struct operation *op);
+void dump_stats(struct exec_stats *stats);
+// Desvia o rastro e o relatório desta thread para file (NULL volta ao stdout).
+void exec_set_output(FILE *file);
+
+// Instância isolada do gerenciador de locks, por thread.
+void lock_manager_init(struct exec_stats *run);
+int lock_manager_free(void);
+enum op_stats lock_manager_request(struct operation *op);
+int lock_manager_next_grant(int *transaction);
+int lock_manager_next_suspect(int *transaction);
+void lock_manager_abort(int transaction);
+int lock_manager_is_blocked(int transaction);
+GSList *lock_manager_waits_for(int transaction);
+int lock_manager_in_cycle(int transaction);
+int lock_manager_holds_locks(int transaction);
+void lock_manager_forget(int transaction);
 
 #endif
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "structs.h"
+#include "gen.h"
+
+// Gerador de escalas sintéticas. Uma fração "hot" dos acessos cai num
+// conjunto quente com 10% das variáveis; as transações seguem 2PL (todos os
+// locks antes do primeiro unlock) e são intercaladas aleatoriamente, com no
+// máximo "active" transações em andamento ao mesmo tempo. Uma fração "scans"
+// dos acessos é uma varredura por prefixo, com lock de intervalo: o prefixo
+// V12 trava [V12,V12~), ou seja, V12 e V120 a V129 (e V1200... se houver).
+// Com "update", a leitura de uma variável que a transação ainda vai escrever
+// pede LOCK-U em vez de LOCK-S, e a escrita converte o U em X.
+
+int parse_gen_params(char *spec, struct gen_params *params) {
+	int values[8] = { 100, 100, 4, 80, 4, 1, 0, 0 };
+	char **fields;
+	int n;
+
+	if (params == NULL)
+		return -1;
+
+	if (spec != NULL) {
+		fields = g_strsplit(spec, ",", 8);
+		n = g_strv_length(fields);
+		for (int i = 0; i < n; i++) {
+			if (strlen(fields[i]) > 0)
+				values[i] = atoi(fields[i]);
+		}
+		g_strfreev(fields);
+	}
+
+	params->transactions = values[0];
+	params->vars = values[1];
+	params->accesses = values[2];
+	params->hot = values[3];
+	params->active = values[4];
+	params->seed = values[5];
+	params->scans = values[6];
+	params->update = values[7];
+
+	if ((params->transactions <= 0) || (params->vars <= 0) ||
+			(params->accesses <= 0) || (params->active <= 0) ||
+			(params->hot < 0) || (params->hot > 100) ||
+			(params->scans < 0) || (params->scans > 100))
+		return -1;
+
+	return 0;
+}
+
+// Variáveis negativas são as varreduras: -1 é o prefixo V0, -2 o V1...
+static struct operation *new_operation(int id, enum command cmd, int var) {
+	struct operation *op;
+
+	op = g_new0(struct operation, 1);
+	op->transaction = id;
+	op->cmd = cmd;
+	if (var >= 0) {
+		op->var = g_strdup_printf("V%d", var);
+		return op;
+	}
+
+	op->low = g_strdup_printf("V%d", -var - 1);
+	op->high = g_strdup_printf("V%d~", -var - 1);
+	op->var = g_strdup_printf("[%s,%s)", op->low, op->high);
+
+	return op;
+}
+
+GSList *generate_transaction(int id, struct gen_params *params, GRand *rand) {
+	GHashTable *held, *written;
+	GSList *ops = NULL;
+	GSList *order = NULL;
+	int *vars, *writes;
+	int hot_vars, var, write;
+	int mode;
+
+	held = g_hash_table_new(g_direct_hash, g_direct_equal);
+	written = g_hash_table_new(g_direct_hash, g_direct_equal);
+	hot_vars = MAX(1, params->vars / 10);
+
+	// Sorteia os acessos antes, para saber na leitura se haverá escrita.
+	vars = g_new(int, params->accesses);
+	writes = g_new(int, params->accesses);
+	for (int i = 0; i < params->accesses; i++) {
+		if (g_rand_int_range(rand, 0, 100) < params->hot)
+			var = g_rand_int_range(rand, 0, hot_vars);
+		else
+			var = g_rand_int_range(rand, 0, params->vars);
+		write = g_rand_int_range(rand, 0, 2);
+		if (g_rand_int_range(rand, 0, 100) < params->scans)
+			var = -var - 1;
+
+		vars[i] = var;
+		writes[i] = write;
+		if (write)
+			g_hash_table_add(written, GINT_TO_POINTER(var + 1));
+	}
+
+	for (int i = 0; i < params->accesses; i++) {
+		var = vars[i];
+		write = writes[i];
+
+		mode = GPOINTER_TO_INT(g_hash_table_lookup(held, GINT_TO_POINTER(var + 1)));
+		if (mode == 0)
+			order = g_slist_prepend(order, GINT_TO_POINTER(var));
+
+		if (write) {
+			if (mode != CMD_LOCK_X + 1) {
+				ops = g_slist_prepend(ops, new_operation(id, CMD_LOCK_X, var));
+				g_hash_table_insert(held, GINT_TO_POINTER(var + 1),
+						GINT_TO_POINTER(CMD_LOCK_X + 1));
+			}
+			ops = g_slist_prepend(ops, new_operation(id, CMD_WRITE, var));
+		}
+		else {
+			if (mode == 0) {
+				int cmd = CMD_LOCK_S;
+				if (params->update &&
+						g_hash_table_contains(written, GINT_TO_POINTER(var + 1)))
+					cmd = CMD_LOCK_U;
+				ops = g_slist_prepend(ops, new_operation(id, cmd, var));
+				g_hash_table_insert(held, GINT_TO_POINTER(var + 1),
+						GINT_TO_POINTER(cmd + 1));
+			}
+			ops = g_slist_prepend(ops, new_operation(id, CMD_READ, var));
+		}
+	}
+
+	// Fase de encolhimento: libera na ordem de aquisição.
+	order = g_slist_reverse(order);
+	for (GSList *l = order; l != NULL; l = l->next)
+		ops = g_slist_prepend(ops, new_operation(id, CMD_UNLOCK, GPOINTER_TO_INT(l->data)));
+
+	g_slist_free(order);
+	g_hash_table_destroy(held);
+	g_hash_table_destroy(written);
+	g_free(vars);
+	g_free(writes);
+
+	return g_slist_reverse(ops);
+}
+
+GSList *generate_operations(struct gen_params *params) {
+	GPtrArray *active;
+	GSList *op_list = NULL;
+	GRand *rand;
+	int next = 1;
+
+	if (params == NULL)
+		return NULL;
+
+	rand = g_rand_new_with_seed(params->seed);
+	active = g_ptr_array_new();
+
+	while ((next <= params->transactions) || (active->len > 0)) {
+		while ((active->len < params->active) && (next <= params->transactions)) {
+			g_ptr_array_add(active, generate_transaction(next, params, rand));
+			next++;
+		}
+
+		int i = g_rand_int_range(rand, 0, active->len);
+		GSList *ops = g_ptr_array_index(active, i);
+		op_list = g_slist_prepend(op_list, ops->data);
+		ops = g_slist_delete_link(ops, ops);
+		if (ops == NULL)
+			g_ptr_array_remove_index(active, i);
+		else
+			g_ptr_array_index(active, i) = ops;
+	}
+
+	g_ptr_array_free(active, TRUE);
+	g_rand_free(rand);
+
+	return g_slist_reverse(op_list);
+}
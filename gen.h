@@ -0,0 +1,25 @@
+#ifndef _GEN_
+#define _GEN_
+
+#include <glib.h>
+
+#include "structs.h"
+
+// Parâmetros do gerador de escalas sintéticas com ponto quente.
+struct gen_params
+{
+	int transactions;
+	int vars;
+	int accesses;
+	int hot;
+	int active;
+	int seed;
+	int scans;
+	int update;
+};
+
+int parse_gen_params(char *spec, struct gen_params *params);
+GSList *generate_transaction(int id, struct gen_params *params, GRand *rand);
+GSList *generate_operations(struct gen_params *params);
+
+#endif
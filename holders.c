@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "holders.h"
+
+// Os slots são reciclados quando a transação solta o último lock, então o
+// bitset cresce com o número de transações ativas ao mesmo tempo, não com o
+// total da escala. Só com mais de HOLDER_BITS ativas os slots altos caem no
+// vetor ordenado, com busca binária.
+
+struct holder_set
+{
+	guint64 *words;
+	int nwords;
+	int count;
+	// Nenhuma palavra antes de first tem bits. Só avança quando uma
+	// varredura passa por ela, para que o remove continue O(1).
+	int first;
+	// Slots >= HOLDER_BITS, em ordem.
+	GArray *extra;
+};
+
+struct holder_set *holder_set_new() {
+	return g_new0(struct holder_set, 1);
+}
+
+void holder_set_free(struct holder_set *set) {
+	if (set == NULL)
+		return;
+
+	if (set->extra != NULL)
+		g_array_free(set->extra, TRUE);
+	g_free(set->words);
+	g_free(set);
+}
+
+// Posição de slot em extra, ou de onde ele entraria.
+static int extra_search(struct holder_set *set, int slot, int *found) {
+	int low = 0, high = set->extra->len;
+
+	while (low < high) {
+		int mid = (low + high) / 2;
+		int value = g_array_index(set->extra, int, mid);
+
+		if (value == slot) {
+			*found = 1;
+			return mid;
+		}
+		if (value < slot)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	*found = 0;
+	return low;
+}
+
+// Retorna 1 se o slot não estava no conjunto.
+int holder_set_add(struct holder_set *set, int slot) {
+	int word = slot / 64;
+	guint64 bit = G_GUINT64_CONSTANT(1) << (slot % 64);
+	int found, pos;
+
+	if (slot >= HOLDER_BITS) {
+		if (set->extra == NULL)
+			set->extra = g_array_new(FALSE, FALSE, sizeof(int));
+		pos = extra_search(set, slot, &found);
+		if (found)
+			return 0;
+		g_array_insert_val(set->extra, pos, slot);
+		set->count++;
+		return 1;
+	}
+
+	if (word >= set->nwords) {
+		int nwords = MAX(word + 1, 2 * set->nwords);
+		set->words = g_renew(guint64, set->words, nwords);
+		memset(set->words + set->nwords, 0, (nwords - set->nwords) * sizeof(guint64));
+		set->nwords = nwords;
+	}
+
+	if (set->words[word] & bit)
+		return 0;
+
+	if (word < set->first)
+		set->first = word;
+	set->words[word] |= bit;
+	set->count++;
+	return 1;
+}
+
+// Retorna 1 se o slot estava no conjunto.
+int holder_set_remove(struct holder_set *set, int slot) {
+	int word = slot / 64;
+	guint64 bit = G_GUINT64_CONSTANT(1) << (slot % 64);
+	int found, pos;
+
+	if (slot >= HOLDER_BITS) {
+		if (set->extra == NULL)
+			return 0;
+		pos = extra_search(set, slot, &found);
+		if (!found)
+			return 0;
+		g_array_remove_index(set->extra, pos);
+		set->count--;
+		return 1;
+	}
+
+	if ((word >= set->nwords) || !(set->words[word] & bit))
+		return 0;
+
+	set->words[word] &= ~bit;
+	set->count--;
+	return 1;
+}
+
+int holder_set_contains(struct holder_set *set, int slot) {
+	int word = slot / 64;
+	int found;
+
+	if ((set == NULL) || (slot < 0))
+		return 0;
+
+	if (slot >= HOLDER_BITS) {
+		if (set->extra != NULL)
+			extra_search(set, slot, &found);
+		return (set->extra != NULL) && found;
+	}
+
+	if (word >= set->nwords)
+		return 0;
+
+	return (set->words[word] >> (slot % 64)) & 1;
+}
+
+int holder_set_count(struct holder_set *set) {
+	return set ? set->count : 0;
+}
+
+// Se alguma transação além de slot está no conjunto. Com o contador, não
+// precisa varrer nada.
+int holder_set_has_other(struct holder_set *set, int slot) {
+	if (set == NULL)
+		return 0;
+
+	return set->count > holder_set_contains(set, slot);
+}
+
+// Menor slot do conjunto maior ou igual a slot, ou -1. Pula palavras
+// vazias inteiras e acha o bit com ctz.
+int holder_set_next(struct holder_set *set, int slot) {
+	int word = slot / 64;
+	guint64 bits;
+	int found, pos;
+
+	if ((set == NULL) || (slot < 0) || (set->count == 0))
+		return -1;
+
+	if (word < set->first) {
+		word = set->first;
+		slot = word * 64;
+	}
+
+	if (slot < HOLDER_BITS) {
+		if (word < set->nwords) {
+			bits = set->words[word] & (~G_GUINT64_CONSTANT(0) << (slot % 64));
+			while (1) {
+				if (bits != 0)
+					break;
+				if ((word == set->first) && (set->words[word] == 0))
+					set->first++;
+				if (++word >= set->nwords)
+					break;
+				bits = set->words[word];
+			}
+			if (bits != 0)
+				return word * 64 + __builtin_ctzll(bits);
+		}
+		slot = HOLDER_BITS;
+	}
+
+	if (set->extra == NULL)
+		return -1;
+
+	pos = extra_search(set, slot, &found);
+	if (pos >= set->extra->len)
+		return -1;
+
+	return g_array_index(set->extra, int, pos);
+}
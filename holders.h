@@ -0,0 +1,23 @@
+#ifndef _HOLDERS_
+#define _HOLDERS_
+
+#include <glib.h>
+
+// Conjunto de transações que têm um lock, indexado pelo slot denso de cada
+// transação. Slots até HOLDER_BITS ficam num bitset; acima disso, num
+// vetor ordenado.
+#define HOLDER_BITS 65536
+
+struct holder_set;
+
+struct holder_set *holder_set_new(void);
+void holder_set_free(struct holder_set *set);
+
+int holder_set_add(struct holder_set *set, int slot);
+int holder_set_remove(struct holder_set *set, int slot);
+int holder_set_contains(struct holder_set *set, int slot);
+int holder_set_count(struct holder_set *set);
+int holder_set_has_other(struct holder_set *set, int slot);
+int holder_set_next(struct holder_set *set, int slot);
+
+#endif
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <glib.h>
+
+#include "interval.h"
+
+// Árvore AVL ordenada pelo início dos intervalos, em que cada nó guarda o
+// nó de maior fim da sua subárvore. Uma busca só desce onde algum intervalo
+// ainda pode alcançar a consulta, então custa O(log n) mais o número de
+// intervalos visitados.
+
+struct interval_node
+{
+	char *low;
+	char *high;
+	gpointer data;
+	int height;
+	struct interval_node *left;
+	struct interval_node *right;
+	// Nó de maior fim nesta subárvore.
+	struct interval_node *max_end;
+};
+
+struct interval_tree
+{
+	struct interval_node *root;
+	int size;
+};
+
+// Compara os fins de dois intervalos. O fim de um ponto é inclusivo e, com
+// a mesma chave, vem depois do fim exclusivo de um intervalo.
+int interval_end_cmp(char *alow, char *ahigh, char *blow, char *bhigh) {
+	int cmp;
+
+	cmp = strcmp(ahigh ? ahigh : alow, bhigh ? bhigh : blow);
+	if (cmp != 0)
+		return cmp;
+
+	return (ahigh == NULL) - (bhigh == NULL);
+}
+
+// Se key vem antes do fim de [low, high).
+static int before_end(char *key, char *low, char *high) {
+	if (high == NULL)
+		return strcmp(key, low) <= 0;
+
+	return strcmp(key, high) < 0;
+}
+
+int interval_overlaps(char *alow, char *ahigh, char *blow, char *bhigh) {
+	return before_end(alow, blow, bhigh) && before_end(blow, alow, ahigh);
+}
+
+// Se [alow, ahigh) contém [blow, bhigh) inteiro.
+int interval_covers(char *alow, char *ahigh, char *blow, char *bhigh) {
+	return (strcmp(alow, blow) <= 0) && (interval_end_cmp(blow, bhigh, alow, ahigh) <= 0);
+}
+
+static int node_cmp(struct interval_node *a, struct interval_node *b) {
+	int cmp;
+
+	cmp = strcmp(a->low, b->low);
+	if (cmp != 0)
+		return cmp;
+
+	return ((uintptr_t)a > (uintptr_t)b) - ((uintptr_t)a < (uintptr_t)b);
+}
+
+static int height(struct interval_node *node) {
+	return node ? node->height : 0;
+}
+
+static void update(struct interval_node *node) {
+	struct interval_node *child[2] = { node->left, node->right };
+
+	node->height = 1 + MAX(height(node->left), height(node->right));
+	node->max_end = node;
+	for (int i = 0; i < 2; i++) {
+		struct interval_node *m;
+
+		if (child[i] == NULL)
+			continue;
+		m = child[i]->max_end;
+		if (interval_end_cmp(m->low, m->high, node->max_end->low, node->max_end->high) > 0)
+			node->max_end = m;
+	}
+}
+
+static struct interval_node *rotate_right(struct interval_node *node) {
+	struct interval_node *left = node->left;
+
+	node->left = left->right;
+	left->right = node;
+	update(node);
+	update(left);
+
+	return left;
+}
+
+static struct interval_node *rotate_left(struct interval_node *node) {
+	struct interval_node *right = node->right;
+
+	node->right = right->left;
+	right->left = node;
+	update(node);
+	update(right);
+
+	return right;
+}
+
+static struct interval_node *balance(struct interval_node *node) {
+	update(node);
+
+	if (height(node->left) > height(node->right) + 1) {
+		if (height(node->left->right) > height(node->left->left))
+			node->left = rotate_left(node->left);
+		return rotate_right(node);
+	}
+
+	if (height(node->right) > height(node->left) + 1) {
+		if (height(node->right->left) > height(node->right->right))
+			node->right = rotate_right(node->right);
+		return rotate_left(node);
+	}
+
+	return node;
+}
+
+static struct interval_node *insert_node(struct interval_node *root, struct interval_node *node) {
+	if (root == NULL)
+		return node;
+
+	if (node_cmp(node, root) < 0)
+		root->left = insert_node(root->left, node);
+	else
+		root->right = insert_node(root->right, node);
+
+	return balance(root);
+}
+
+// Desliga o menor nó da subárvore e o devolve em min.
+static struct interval_node *remove_min(struct interval_node *root, struct interval_node **min) {
+	if (root->left == NULL) {
+		*min = root;
+		return root->right;
+	}
+
+	root->left = remove_min(root->left, min);
+	return balance(root);
+}
+
+// Os nós são religados, nunca copiados, para que os ponteiros devolvidos
+// por interval_tree_insert continuem válidos.
+static struct interval_node *remove_node(struct interval_node *root, struct interval_node *node) {
+	struct interval_node *min;
+	int cmp;
+
+	if (root == NULL)
+		return NULL;
+
+	cmp = node_cmp(node, root);
+	if (cmp < 0) {
+		root->left = remove_node(root->left, node);
+		return balance(root);
+	}
+	if (cmp > 0) {
+		root->right = remove_node(root->right, node);
+		return balance(root);
+	}
+
+	if (root->right == NULL)
+		return root->left;
+
+	root->right = remove_min(root->right, &min);
+	min->left = root->left;
+	min->right = root->right;
+
+	return balance(min);
+}
+
+static struct interval_node *find_node(struct interval_node *node, char *low, char *high,
+		interval_func func, gpointer user_data) {
+	struct interval_node *found;
+
+	// Nenhum intervalo desta subárvore chega até low.
+	if ((node == NULL) || !before_end(low, node->max_end->low, node->max_end->high))
+		return NULL;
+
+	found = find_node(node->left, low, high, func, user_data);
+	if (found != NULL)
+		return found;
+
+	// Este nó e os da direita começam depois do fim da consulta.
+	if (!before_end(node->low, low, high))
+		return NULL;
+
+	if (interval_overlaps(node->low, node->high, low, high) && func(node->data, user_data))
+		return node;
+
+	return find_node(node->right, low, high, func, user_data);
+}
+
+static void free_nodes(struct interval_node *node) {
+	if (node == NULL)
+		return;
+
+	free_nodes(node->left);
+	free_nodes(node->right);
+	g_free(node);
+}
+
+struct interval_tree *interval_tree_new() {
+	return g_new0(struct interval_tree, 1);
+}
+
+void interval_tree_free(struct interval_tree *tree) {
+	if (tree == NULL)
+		return;
+
+	free_nodes(tree->root);
+	g_free(tree);
+}
+
+int interval_tree_size(struct interval_tree *tree) {
+	return tree->size;
+}
+
+// As chaves não são copiadas e precisam viver tanto quanto o nó.
+struct interval_node *interval_tree_insert(struct interval_tree *tree, char *low,
+		char *high, gpointer data) {
+	struct interval_node *node;
+
+	node = g_new0(struct interval_node, 1);
+	node->low = low;
+	node->high = high;
+	node->data = data;
+	node->height = 1;
+	node->max_end = node;
+
+	tree->root = insert_node(tree->root, node);
+	tree->size++;
+
+	return node;
+}
+
+void interval_tree_remove(struct interval_tree *tree, struct interval_node *node) {
+	if (node == NULL)
+		return;
+
+	tree->root = remove_node(tree->root, node);
+	tree->size--;
+	g_free(node);
+}
+
+struct interval_node *interval_tree_find(struct interval_tree *tree, char *low,
+		char *high, interval_func func, gpointer user_data) {
+	return find_node(tree->root, low, high, func, user_data);
+}
+
+gpointer interval_node_data(struct interval_node *node) {
+	return node ? node->data : NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef _INTERVAL_
+#define _INTERVAL_
+
+#include <glib.h>
+
+// Árvore de intervalos de chaves (strings). Um intervalo [low, high) tem
+// high exclusivo; high NULL é o ponto low.
+struct interval_tree;
+struct interval_node;
+
+typedef gboolean (*interval_func)(gpointer data, gpointer user_data);
+
+struct interval_tree *interval_tree_new(void);
+void interval_tree_free(struct interval_tree *tree);
+int interval_tree_size(struct interval_tree *tree);
+
+struct interval_node *interval_tree_insert(struct interval_tree *tree, char *low,
+		char *high, gpointer data);
+void interval_tree_remove(struct interval_tree *tree, struct interval_node *node);
+
+// Visita os intervalos que se sobrepõem a [low, high) até func retornar
+// TRUE; devolve esse nó, ou NULL.
+struct interval_node *interval_tree_find(struct interval_tree *tree, char *low,
+		char *high, interval_func func, gpointer user_data);
+gpointer interval_node_data(struct interval_node *node);
+
+int interval_overlaps(char *alow, char *ahigh, char *blow, char *bhigh);
+int interval_covers(char *alow, char *ahigh, char *blow, char *bhigh);
+int interval_end_cmp(char *alow, char *ahigh, char *blow, char *bhigh);
+
+#endif
@@ -1,53 +1,345 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
 #include <glib.h>
 
 #include "structs.h"
 #include "parser.h"
 #include "exec.h"
+#include "tso.h"
+#include "gen.h"
+#include "dlm.h"
+#include "shm.h"
+#include "sim.h"
+#include "server.h"
+#include "split.h"
+#include "batch.h"
 
-void operation_clean(struct operation *op) {
-	if (op == NULL)
-		return;
+static int has_ranges(GSList *op_list) {
+	for (GSList *l = op_list; l != NULL; l = l->next) {
+		if (((struct operation *)l->data)->high != NULL)
+			return 1;
+	}
+
+	return 0;
+}
 
-	if (op->var != NULL)
-		g_free(op->var);
+static int has_update_locks(GSList *op_list) {
+	for (GSList *l = op_list; l != NULL; l = l->next) {
+		if (((struct operation *)l->data)->cmd == CMD_LOCK_U)
+			return 1;
+	}
 
-	g_free(op);
+	return 0;
 }
 
-void operations_cleanup(GSList *op_list) {
-	if (op_list == NULL)
-		return;
+static int parse_detect_policy(char *spec, struct detect_policy *policy) {
+	int values[3] = { 0, 0, 0 };
+	char **fields;
+	int n;
 
-	g_slist_free_full(op_list, (GDestroyNotify)operation_clean);
-	op_list = NULL;
+	fields = g_strsplit(spec, ",", 3);
+	n = g_strv_length(fields);
+	for (int i = 0; i < n; i++)
+		values[i] = atoi(fields[i]);
+	g_strfreev(fields);
+
+	if ((values[0] < 0) || (values[1] < 0) || (values[2] < 0))
+		return -1;
+
+	policy->interval = values[0];
+	policy->blocked = values[1];
+	policy->waited = values[2];
+
+	return 0;
+}
+
+// arquivo[,operações]; sem o intervalo, só o SIGUSR1 grava. O que vem
+// depois da última vírgula tem que ser o intervalo, então um caminho com
+// vírgula precisa dele explícito ("a,b.ckpt,0").
+static int parse_checkpoint_policy(char *spec, struct checkpoint_policy *policy) {
+	char *comma = strrchr(spec, ',');
+	char *end;
+	long every = 0;
+
+	if (comma != NULL) {
+		errno = 0;
+		every = strtol(comma + 1, &end, 10);
+		if ((comma[1] == '\0') || (*end != '\0') || (errno != 0) ||
+				(every < 0) || (every > G_MAXINT))
+			return -1;
+		*comma = '\0';
+	}
+
+	if (strlen(spec) == 0)
+		return -1;
+
+	policy->path = spec;
+	policy->every = every;
+
+	return 0;
+}
+
+static void on_checkpoint_signal(int sig) {
+	checkpoint_requested = 1;
+}
+
+static void usage(char *name) {
+	printf("Usage: %s [-t | -T | -k sites | -p clients | -m mpl,think,ticks] "
+			"[-d interval,blocked,waited] [-j threads] [-q] "
+			"[-g trans,vars,accesses,hot,active,seed,scans,update | file]\n", name);
+	printf("       %s [-c checkpoint[,every]] [-r checkpoint] [-d interval,blocked,waited] "
+			"[-q] [-g ... | file]\n", name);
+	printf("       %s -s socket | -s -\n", name);
+	printf("       %s -b directory|glob [-j threads] [-d interval,blocked,waited]\n", name);
+	printf("\t-t\ttimestamp ordering instead of 2PL\n");
+	printf("\t-T\ttimestamp ordering with the Thomas write rule\n");
+	printf("\t-k\tdistributed lock manager over this many sites, with\n"
+			"\t\tedge-chasing deadlock detection\n");
+	printf("\t-p\tshared-memory lock table used by this many client processes,\n"
+			"\t\twith a deadlock detection daemon\n");
+	printf("\t-m\tclosed-loop simulation of up to mpl clients over the -g workload,\n"
+			"\t\treporting throughput for each multiprogramming level\n");
+	printf("\t-s\tserve T:CMD:VAR requests on a Unix socket, or on stdin/stdout\n");
+	printf("\t-d\tbatched deadlock detection every interval steps, when blocked\n"
+			"\t\ttransactions are waiting or when a request waited for waited steps\n");
+	printf("\t-b\trun every schedule in a directory or glob concurrently and\n"
+			"\t\tsummarize the outcome of each one\n");
+	printf("\t-j\treplay independent groups of transactions on this many threads\n"
+			"\t\t(with -b, run this many schedules at a time)\n");
+	printf("\t-c\twrite the 2PL executor state to checkpoint every this many\n"
+			"\t\toperations and on SIGUSR1\n");
+	printf("\t-r\tresume the same schedule from checkpoint\n");
+	printf("\t-q\tdo not trace each operation\n");
+	printf("\t-g\tgenerate a synthetic hot-spot schedule\n");
 }
 
 int main(int argc, char **argv) {
 	GSList *op_list;
+	struct exec_stats run;
+	struct gen_params params;
+	struct sim_params sim;
+	char *gen_spec = NULL;
+	char *sim_spec = NULL;
+	char *socket_path = NULL;
+	char *batch_path = NULL;
+	char *resume_path = NULL;
+	char *name;
+	int timestamp = 0;
+	int thomas = 0;
+	int nsites = 0;
+	int nclients = 0;
+	int nthreads = 0;
+	int opt;
 
 	op_list = NULL;
 
-	if (argc < 2) {
-		printf("ERROR!\n");
+	while ((opt = getopt(argc, argv, "tTqg:d:k:p:m:s:j:b:c:r:")) != -1) {
+		switch (opt) {
+			case 't':
+				timestamp = 1;
+				break;
+			case 'T':
+				timestamp = 1;
+				thomas = 1;
+				break;
+			case 'q':
+				verbose = 0;
+				break;
+			case 'g':
+				gen_spec = optarg;
+				break;
+			case 'k':
+				nsites = atoi(optarg);
+				if (nsites <= 0) {
+					printf("Invalid number of sites.\n");
+					return 1;
+				}
+				break;
+			case 'p':
+				nclients = atoi(optarg);
+				if (nclients <= 0) {
+					printf("Invalid number of clients.\n");
+					return 1;
+				}
+				break;
+			case 'm':
+				sim_spec = optarg;
+				break;
+			case 's':
+				socket_path = optarg;
+				break;
+			case 'b':
+				batch_path = optarg;
+				break;
+			case 'j':
+				nthreads = atoi(optarg);
+				if (nthreads <= 0) {
+					printf("Invalid number of threads.\n");
+					return 1;
+				}
+				break;
+			case 'c':
+				if (parse_checkpoint_policy(optarg, &checkpoint_policy) < 0) {
+					printf("Invalid checkpoint parameters.\n");
+					return 1;
+				}
+				break;
+			case 'r':
+				resume_path = optarg;
+				break;
+			case 'd':
+				if (parse_detect_policy(optarg, &detect_policy) < 0) {
+					printf("Invalid detection parameters.\n");
+					return 1;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if ((nclients > 0) && (timestamp || nsites)) {
+		printf("The shared lock table only runs 2PL.\n");
+		return 1;
+	}
+
+	if ((nsites > 0) && (timestamp || detect_policy.interval ||
+				detect_policy.blocked || detect_policy.waited)) {
+		printf("The distributed lock manager has its own deadlock detection.\n");
+		return 1;
+	}
+
+	if (((checkpoint_policy.path != NULL) || (resume_path != NULL)) &&
+			(timestamp || nsites || nclients || sim_spec || socket_path ||
+			 nthreads || batch_path)) {
+		printf("Checkpoints are only taken by the centralized 2PL executor.\n");
+		return 1;
+	}
+
+	if (checkpoint_policy.path != NULL) {
+		struct sigaction action;
+
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = on_checkpoint_signal;
+		sigaction(SIGUSR1, &action, NULL);
+	}
+
+	if (batch_path != NULL) {
+		if (timestamp || nsites || nclients || sim_spec || socket_path || gen_spec) {
+			printf("The batch runner only runs 2PL over schedule files.\n");
+			return 1;
+		}
+		return exec_batch(batch_path, nthreads ? nthreads : g_get_num_processors());
+	}
+
+	if ((nthreads > 0) && (timestamp || nsites || nclients || sim_spec || socket_path)) {
+		printf("The parallel replay only runs 2PL.\n");
+		return 1;
+	}
+
+	// A detecção em lotes conta passos da escala inteira; separada por
+	// componentes, ela dispararia em outros momentos.
+	if ((nthreads > 0) && (detect_policy.interval || detect_policy.blocked ||
+				detect_policy.waited)) {
+		printf("The parallel replay needs immediate deadlock detection.\n");
+		return 1;
+	}
+
+	if (socket_path != NULL) {
+		if (timestamp || nsites || nclients || sim_spec || detect_policy.interval ||
+				detect_policy.blocked || detect_policy.waited) {
+			printf("The lock server only runs 2PL with its own deadlock detection.\n");
+			return 1;
+		}
+		return exec_server(socket_path);
+	}
+
+	if (sim_spec != NULL) {
+		if (timestamp || nsites || nclients) {
+			printf("The closed-loop simulator only runs 2PL.\n");
+			return 1;
+		}
+		if (detect_policy.interval || detect_policy.blocked || detect_policy.waited) {
+			printf("The closed-loop simulator has its own deadlock detection.\n");
+			return 1;
+		}
+		if ((parse_sim_params(sim_spec, &sim) < 0) ||
+				(parse_gen_params(gen_spec, &params) < 0)) {
+			printf("Invalid simulation parameters.\n");
+			return 1;
+		}
+		printf("Simulating up to %d clients over %d variables (%d%% hot), "
+				"think time %d, %d ticks per level\n",
+				sim.mpl, params.vars, params.hot, sim.think, sim.ticks);
+		exec_closed_loop(&params, &sim);
 		return 0;
 	}
 
-	printf("Parsing \"%s\"\n", argv[1]);
-	op_list = parse_operations(argv[1]);
+	if (gen_spec != NULL) {
+		if (parse_gen_params(gen_spec, &params) < 0) {
+			printf("Invalid generator parameters.\n");
+			return 1;
+		}
+		name = "synthetic";
+		printf("Generating %d transactions over %d variables (%d%% hot)\n",
+				params.transactions, params.vars, params.hot);
+		op_list = generate_operations(&params);
+	}
+	else {
+		if (optind >= argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		name = argv[optind];
+		printf("Parsing \"%s\"\n", name);
+		op_list = parse_operations(name);
+	}
+
 	if (op_list == NULL) {
 		printf("Error parsing file.\n");
 		return 0;
 	}
 
+	if ((timestamp || nsites || nclients) && has_ranges(op_list)) {
+		printf("Range locks need the centralized 2PL executor.\n");
+		return 1;
+	}
+
+	if ((nclients > 0) && has_update_locks(op_list)) {
+		printf("The shared lock table has no update locks.\n");
+		return 1;
+	}
+
 	printf("%d operations found\n", g_slist_length(op_list));
-	g_slist_foreach(op_list, (GFunc)dump_operation, NULL);
+	if (verbose)
+		g_slist_foreach(op_list, (GFunc)dump_operation, NULL);
 
-	printf("Executing \"%s\"\n", argv[1]);
-	exec_operations(op_list);
+	printf("Executing \"%s\"\n", name);
+	if (timestamp)
+		exec_operations_ts(op_list, thomas, &run);
+	else if (nclients > 0)
+		exec_operations_shm(op_list, nclients, &run);
+	else if (nsites > 0)
+		exec_operations_dlm(op_list, nsites, &run);
+	else if (nthreads > 0)
+		exec_operations_parallel(op_list, nthreads, &run);
+	else if (resume_path != NULL) {
+		if (exec_operations_resume(op_list, resume_path, &run) < 0) {
+			operations_cleanup(op_list);
+			return 1;
+		}
+	}
+	else
+		exec_operations(op_list, &run);
+	dump_stats(&run);
 
-	printf("Cleaning \"%s\"\n", argv[1]);
+	printf("Cleaning \"%s\"\n", name);
 	operations_cleanup(op_list);
+
+	return 0;
 }
@@ -4,8 +4,7 @@
 #include <glib.h>
 
 #include "structs.h"
-
-GSList *op_list;
+#include "parser.h"
 
 enum command strcmd_to_cmd(char *cmd)
 {
@@ -20,6 +19,8 @@ enum command strcmd_to_cmd(char *cmd)
 		return CMD_LOCK_S;
 	else if (strcmp(cmd, "LOCK-X") == 0)
 		return CMD_LOCK_X;
+	else if (strcmp(cmd, "LOCK-U") == 0)
+		return CMD_LOCK_U;
 	else if (strcmp(cmd, "UNLOCK") == 0)
 		return CMD_UNLOCK;
 	else
@@ -37,6 +38,8 @@ char *cmd_to_strcmd(enum command cmd)
 			return "LOCK-S";
 		case CMD_LOCK_X:
 			return "LOCK-X";
+		case CMD_LOCK_U:
+			return "LOCK-U";
 		case CMD_UNLOCK:
 			return "UNLOCK";
 		case CMD_UNKNOWN:
@@ -47,15 +50,43 @@ char *cmd_to_strcmd(enum command cmd)
 	return "UNKNOWN";
 }
 
-static void parse_command(char *command) {
+// Intervalo de chaves no formato [low,high), com low < high.
+static int parse_range(struct operation *op) {
+	char *comma;
+	int size;
+
+	op->low = NULL;
+	op->high = NULL;
+	if (op->var[0] != '[')
+		return 0;
+
+	size = strlen(op->var);
+	comma = strchr(op->var, ',');
+	if ((size < 5) || (op->var[size - 1] != ')') || (comma == NULL))
+		return -1;
+
+	op->low = g_strndup(op->var + 1, comma - op->var - 1);
+	op->high = g_strndup(comma + 1, op->var + size - 1 - comma - 1);
+	if ((strlen(op->low) == 0) || (strcmp(op->low, op->high) >= 0)) {
+		g_free(op->low);
+		g_free(op->high);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Uma linha T:CMD:VAR. Retorna NULL se o intervalo for inválido; comandos
+// desconhecidos voltam como CMD_UNKNOWN.
+struct operation *parse_operation(char *command) {
 	char *trs, *cmd, *val;
 	long size;
 	struct operation *op;
 
 	if (command == NULL)
-		return;
+		return NULL;
 
-	size = strlen(command);
+	size = strlen(command) + 1;
 	trs = malloc(size);
 	cmd = malloc(size);
 	val = malloc(size);
@@ -69,8 +100,11 @@ static void parse_command(char *command) {
 	op->cmd = strcmd_to_cmd(cmd);
 	op->var = strdup(val);
 
-	if (op->cmd != CMD_UNKNOWN)
-		op_list = g_slist_append(op_list, op);
+	if (parse_range(op) < 0) {
+		g_free(op->var);
+		g_free(op);
+		op = NULL;
+	}
 
 	if (trs)
 		g_free(trs);
@@ -78,11 +112,32 @@ static void parse_command(char *command) {
 		g_free(cmd);
 	if (val)
 		g_free(val);
+
+	return op;
+}
+
+// Acrescenta a operação de command no começo de op_list.
+static GSList *parse_command(char *command, GSList *op_list) {
+	struct operation *op;
+
+	if (command == NULL)
+		return op_list;
+
+	op = parse_operation(command);
+	if (op == NULL)
+		printf("Invalid range: %s\n", command);
+	else if (op->cmd != CMD_UNKNOWN)
+		op_list = g_slist_prepend(op_list, op);
+	else
+		operation_clean(op);
+
+	return op_list;
 }
 
+// Sem estado global: várias threads podem ler escalas ao mesmo tempo.
 GSList *parse_operations(char *filename) {
-	char *tok, *file_buffer;
-	GSList *cmd_list = NULL;
+	char *tok, *file_buffer, *save;
+	GSList *op_list = NULL;
 
 	if (filename == NULL)
 		return NULL;
@@ -92,22 +147,34 @@ GSList *parse_operations(char *filename) {
 		return NULL;
 	}
 
-	tok = strtok(file_buffer, "\n");
+	tok = strtok_r(file_buffer, "\n", &save);
 	while (tok != NULL) {
-		cmd_list = g_slist_append(cmd_list, g_strdup(tok));
-		tok = strtok(NULL, "\n");
-	}
-
-	for (int i = 0; i < g_slist_length(cmd_list); i++) {
-		char *tmp = g_slist_nth_data(cmd_list, i);
-		parse_command(tmp);
+		op_list = parse_command(tok, op_list);
+		tok = strtok_r(NULL, "\n", &save);
 	}
 
 	if (file_buffer)
 		g_free(file_buffer);
 
+	return g_slist_reverse(op_list);
+}
+
+void operation_clean(struct operation *op) {
+	if (op == NULL)
+		return;
 
-	g_slist_free(cmd_list);
+	if (op->var != NULL)
+		g_free(op->var);
 
-	return op_list;
+	g_free(op->low);
+	g_free(op->high);
+	g_free(op);
+}
+
+void operations_cleanup(GSList *op_list) {
+	if (op_list == NULL)
+		return;
+
+	g_slist_free_full(op_list, (GDestroyNotify)operation_clean);
+	op_list = NULL;
 }
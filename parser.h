@@ -5,6 +5,9 @@
 
 enum command strcmd_to_cmd(char *cmd);
 char *cmd_to_strcmd(enum command cmd);
+struct operation *parse_operation(char *command);
 GSList *parse_operations(char *filename);
+void operation_clean(struct operation *op);
+void operations_cleanup(GSList *op_list);
 
 #endif
@@ -0,0 +1,529 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib.h>
+
+#include "structs.h"
+#include "parser.h"
+#include "exec.h"
+#include "server.h"
+
+// Modo daemon. Os clientes mandam pedidos T:CMD:VAR, um por linha, sem
+// esperar as respostas; o servidor responde, na ordem em que as coisas
+// acontecem:
+//
+//	GRANT T:CMD:VAR		pedido concedido (na hora ou depois de esperar)
+//	WAIT T:CMD:VAR		pedido em espera; o GRANT vem depois
+//	ERROR T:CMD:VAR		pedido inválido para a transação, que é abortada
+//	ABORT T			a transação foi abortada por erro
+//	VICTIM T		a transação foi abortada para quebrar um deadlock
+//	ABORTED T:CMD:VAR	pedido de uma transação já abortada, ignorado
+//	ENDED T			resposta a T:END
+//	INVALID linha		linha que não é um pedido
+//
+// Pedidos de uma transação em espera ficam na fila dela e só rodam depois do
+// GRANT, como no executor de escalas. Os ids de transação são globais e cada
+// um pertence à conexão que o usou primeiro. Uma transação que soltou todos
+// os locks e não tem nada em espera terminou: o servidor a esquece e o id
+// fica livre. T:END encerra uma transação antes disso (soltando o que ela
+// ainda tem) ou esquece uma abortada; ao fechar a conexão, as transações
+// dela que ainda têm locks são abortadas.
+//
+// A cada passo do laço de eventos o servidor faz uma leitura por conexão
+// pronta, executa todos os pedidos que chegaram nela, entrega os grants e
+// resolve os deadlocks que eles causaram, e só então faz uma escrita por
+// conexão com todas as respostas do passo.
+
+struct server_conn
+{
+	int in;
+	int out;
+	GString *input;
+	GString *output;
+	// Transações (ids) que pertencem a esta conexão.
+	GHashTable *transactions;
+	int closed;
+};
+
+struct server_transaction
+{
+	int id;
+	struct server_conn *conn;
+	int aborted;
+	// Já soltou algum lock: quando não tiver mais nenhum, terminou.
+	int unlocked;
+	// Pedido em espera e os que chegaram depois dele.
+	struct operation *waiting;
+	GQueue pending;
+	// Pedidos recebidos, liberados quando o gerenciador de locks não guarda
+	// mais nenhum deles.
+	GSList *ops;
+};
+
+static GHashTable *transaction_table;
+static GPtrArray *conns;
+// As tabelas de lock usam as variáveis como chave, então elas vivem até o
+// servidor parar, mesmo depois que as operações são liberadas.
+static GStringChunk *vars;
+static struct exec_stats server_run;
+static volatile sig_atomic_t stopping;
+static long ticks;
+static long reads;
+static long writes;
+
+static void reply(struct server_conn *conn, char *fmt, ...) {
+	va_list args;
+
+	va_start(args, fmt);
+	g_string_append_vprintf(conn->output, fmt, args);
+	va_end(args);
+}
+
+static void reply_op(struct server_conn *conn, char *status, struct operation *op) {
+	reply(conn, "%s %d:%s:%s\n", status, op->transaction, cmd_to_strcmd(op->cmd), op->var);
+}
+
+static void free_operation(gpointer data) {
+	struct operation *op = data;
+
+	g_free(op->low);
+	g_free(op->high);
+	g_free(op);
+}
+
+static void free_transaction(gpointer data) {
+	struct server_transaction *t = data;
+
+	g_queue_clear(&t->pending);
+	g_slist_free_full(t->ops, free_operation);
+	g_free(t);
+}
+
+// Libera a transação no gerenciador e aqui; o id pode ser reusado.
+static void forget_transaction(struct server_transaction *t) {
+	lock_manager_forget(t->id);
+	g_hash_table_remove(t->conn->transactions, GINT_TO_POINTER(t->id));
+	g_hash_table_remove(transaction_table, GINT_TO_POINTER(t->id));
+}
+
+// Sem espera, fila ou locks, nada no gerenciador aponta para os pedidos
+// da transação. Se ela já tinha soltado locks, terminou e é esquecida: t
+// não vale mais depois daqui.
+static void release_operations(struct server_transaction *t) {
+	if ((t->waiting != NULL) || !g_queue_is_empty(&t->pending) ||
+			lock_manager_holds_locks(t->id))
+		return;
+
+	g_slist_free_full(t->ops, free_operation);
+	t->ops = NULL;
+
+	if (t->unlocked && !t->aborted)
+		forget_transaction(t);
+}
+
+static void abort_transaction(struct server_transaction *t, char *reason) {
+	struct operation *op;
+
+	t->aborted = 1;
+	t->waiting = NULL;
+	server_run.aborts++;
+	lock_manager_abort(t->id);
+	reply(t->conn, "%s %d\n", reason, t->id);
+
+	while ((op = g_queue_pop_head(&t->pending)) != NULL)
+		reply_op(t->conn, "ABORTED", op);
+	release_operations(t);
+}
+
+static void execute(struct server_transaction *t, struct operation *op) {
+	enum op_stats stats;
+
+	stats = lock_manager_request(op);
+	if (stats == OP_OK) {
+		t->unlocked |= (op->cmd == CMD_UNLOCK);
+		reply_op(t->conn, "GRANT", op);
+	}
+	else if (stats == OP_WAIT) {
+		t->waiting = op;
+		reply_op(t->conn, "WAIT", op);
+	}
+	else {
+		reply_op(t->conn, "ERROR", op);
+		abort_transaction(t, "ABORT");
+	}
+}
+
+static void run_pending(struct server_transaction *t) {
+	struct operation *op;
+
+	while (!t->aborted && (t->waiting == NULL) &&
+			((op = g_queue_pop_head(&t->pending)) != NULL))
+		execute(t, op);
+	release_operations(t);
+}
+
+// T:END (ou T:END:).
+static int parse_end(char *line, int *id) {
+	int n = -1;
+
+	sscanf(line, "%d:END%n", id, &n);
+
+	return (n > 0) && ((line[n] == '\0') || (strcmp(line + n, ":") == 0));
+}
+
+static void end_transaction(struct server_conn *conn, int id, char *line) {
+	struct server_transaction *t;
+
+	t = g_hash_table_lookup(transaction_table, GINT_TO_POINTER(id));
+	if ((t != NULL) && (t->conn != conn)) {
+		reply(conn, "INVALID %s\n", line);
+		return;
+	}
+
+	// Sem nada em espera, o END solta os locks como um commit; em espera, a
+	// transação é abortada e os pedidos da fila não rodam mais.
+	if ((t != NULL) && !t->aborted) {
+		struct operation *op;
+
+		if (t->waiting != NULL)
+			server_run.aborts++;
+		if ((t->waiting != NULL) || lock_manager_holds_locks(t->id))
+			lock_manager_abort(t->id);
+		t->waiting = NULL;
+		while ((op = g_queue_pop_head(&t->pending)) != NULL)
+			reply_op(conn, "ABORTED", op);
+	}
+
+	if (t != NULL)
+		forget_transaction(t);
+	reply(conn, "ENDED %d\n", id);
+}
+
+static void submit(struct server_conn *conn, char *line) {
+	struct server_transaction *t;
+	struct operation *op;
+	char *var;
+	int id;
+
+	if (parse_end(line, &id)) {
+		end_transaction(conn, id, line);
+		return;
+	}
+
+	op = parse_operation(line);
+	if ((op == NULL) || (op->cmd == CMD_UNKNOWN) || (op->var[0] == '\0')) {
+		reply(conn, "INVALID %s\n", line);
+		if (op != NULL) {
+			g_free(op->var);
+			free_operation(op);
+		}
+		return;
+	}
+
+	var = g_string_chunk_insert_const(vars, op->var);
+	g_free(op->var);
+	op->var = var;
+
+	t = g_hash_table_lookup(transaction_table, GINT_TO_POINTER(op->transaction));
+	if (t == NULL) {
+		t = g_new0(struct server_transaction, 1);
+		t->id = op->transaction;
+		t->conn = conn;
+		g_queue_init(&t->pending);
+		g_hash_table_insert(transaction_table, GINT_TO_POINTER(t->id), t);
+		g_hash_table_add(conn->transactions, GINT_TO_POINTER(t->id));
+		server_run.transactions++;
+	}
+	else if (t->conn != conn) {
+		reply(conn, "INVALID %s\n", line);
+		free_operation(op);
+		return;
+	}
+
+	if (t->aborted) {
+		reply_op(conn, "ABORTED", op);
+		free_operation(op);
+		return;
+	}
+
+	server_run.operations++;
+	t->ops = g_slist_prepend(t->ops, op);
+	if (t->waiting != NULL) {
+		g_queue_push_tail(&t->pending, op);
+		return;
+	}
+
+	execute(t, op);
+	release_operations(t);
+}
+
+// Entrega os grants e quebra os deadlocks novos; cada vítima pode liberar
+// mais grants.
+static void settle() {
+	struct server_transaction *t;
+	int id, progress;
+
+	do {
+		progress = 0;
+		while (lock_manager_next_grant(&id)) {
+			t = g_hash_table_lookup(transaction_table, GINT_TO_POINTER(id));
+			reply_op(t->conn, "GRANT", t->waiting);
+			t->waiting = NULL;
+			run_pending(t);
+		}
+
+		while (lock_manager_next_suspect(&id)) {
+			if (lock_manager_in_cycle(id)) {
+				server_run.deadlocks++;
+				abort_transaction(g_hash_table_lookup(transaction_table,
+							GINT_TO_POINTER(id)), "VICTIM");
+				progress = 1;
+			}
+		}
+	} while (progress);
+}
+
+// Uma leitura só; as linhas completas viram pedidos e o resto fica para o
+// próximo passo.
+static void read_input(struct server_conn *conn) {
+	char buffer[SERVER_READ_SIZE];
+	char *line, *end;
+	gsize done = 0;
+	ssize_t n;
+
+	n = read(conn->in, buffer, sizeof(buffer));
+	reads++;
+	if (n <= 0) {
+		if ((n == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+			conn->closed = 1;
+		return;
+	}
+	g_string_append_len(conn->input, buffer, n);
+
+	while ((end = memchr(conn->input->str + done, '\n',
+					conn->input->len - done)) != NULL) {
+		line = conn->input->str + done;
+		*end = '\0';
+		done = end - conn->input->str + 1;
+		if ((end > line) && (end[-1] == '\r'))
+			end[-1] = '\0';
+		if (line[0] != '\0')
+			submit(conn, line);
+	}
+	g_string_erase(conn->input, 0, done);
+}
+
+// Uma escrita com tudo que o passo produziu; o que não couber sai depois.
+static void flush_output(struct server_conn *conn) {
+	ssize_t n;
+
+	if (conn->output->len == 0)
+		return;
+
+	n = write(conn->out, conn->output->str, conn->output->len);
+	writes++;
+	if (n > 0)
+		g_string_erase(conn->output, 0, n);
+	else if ((n < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+		g_string_truncate(conn->output, 0);
+		conn->closed = 1;
+	}
+}
+
+static struct server_conn *new_conn(int in, int out) {
+	struct server_conn *conn;
+
+	conn = g_new0(struct server_conn, 1);
+	conn->in = in;
+	conn->out = out;
+	conn->input = g_string_new(NULL);
+	conn->output = g_string_new(NULL);
+	conn->transactions = g_hash_table_new(g_direct_hash, g_direct_equal);
+	g_ptr_array_add(conns, conn);
+
+	return conn;
+}
+
+// Aborta, sem avisar ninguém, as transações da conexão que ainda seguram
+// locks, e esquece todas para que os ids possam ser reusados.
+static void close_conn(struct server_conn *conn) {
+	struct server_transaction *t;
+	GHashTableIter iter;
+	gpointer id;
+
+	g_hash_table_iter_init(&iter, conn->transactions);
+	while (g_hash_table_iter_next(&iter, &id, NULL)) {
+		t = g_hash_table_lookup(transaction_table, id);
+		if (!t->aborted && ((t->waiting != NULL) || lock_manager_holds_locks(t->id)))
+			lock_manager_abort(t->id);
+		lock_manager_forget(t->id);
+		g_hash_table_remove(transaction_table, id);
+	}
+	g_hash_table_destroy(conn->transactions);
+
+	if (conn->in > STDERR_FILENO)
+		close(conn->in);
+	g_string_free(conn->input, TRUE);
+	g_string_free(conn->output, TRUE);
+	g_ptr_array_remove(conns, conn);
+	g_free(conn);
+}
+
+static int open_socket(char *path) {
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long.\n");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	unlink(path);
+	if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+			(listen(fd, SOMAXCONN) < 0)) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	return fd;
+}
+
+static void accept_conns(int listen_fd) {
+	int fd;
+
+	while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		new_conn(fd, fd);
+	}
+}
+
+static void on_signal(int sig) {
+	stopping = 1;
+}
+
+int exec_server(char *path) {
+	struct sigaction action;
+	struct pollfd *fds;
+	GTimer *timer;
+	int listen_fd = -1;
+	int nfds, stdio;
+
+	stdio = (strcmp(path, "-") == 0);
+	if (!stdio && ((listen_fd = open_socket(path)) < 0))
+		return 1;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	transaction_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, free_transaction);
+	conns = g_ptr_array_new();
+	vars = g_string_chunk_new(4096);
+	lock_manager_init(&server_run);
+	timer = g_timer_new();
+
+	if (stdio)
+		new_conn(STDIN_FILENO, STDOUT_FILENO);
+	else
+		fprintf(stderr, "Listening on %s\n", path);
+
+	while (!stopping && (!stdio || (conns->len > 0))) {
+		// Entrada de cada conexão, a saída das que têm respostas pendentes
+		// e o socket de escuta por último.
+		fds = g_new0(struct pollfd, 2 * conns->len + 1);
+		for (int i = 0; i < conns->len; i++) {
+			struct server_conn *conn = g_ptr_array_index(conns, i);
+			fds[2 * i].fd = conn->in;
+			fds[2 * i].events = POLLIN;
+			fds[2 * i + 1].fd = conn->output->len ? conn->out : -1;
+			fds[2 * i + 1].events = POLLOUT;
+		}
+		nfds = 2 * conns->len;
+		if (listen_fd >= 0) {
+			fds[nfds].fd = listen_fd;
+			fds[nfds].events = POLLIN;
+			nfds++;
+		}
+
+		if (poll(fds, nfds, -1) < 0) {
+			g_free(fds);
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		ticks++;
+
+		for (int i = 0; i < conns->len; i++) {
+			if (fds[2 * i].revents & (POLLIN | POLLHUP | POLLERR))
+				read_input(g_ptr_array_index(conns, i));
+		}
+		if ((listen_fd >= 0) && (fds[nfds - 1].revents & POLLIN))
+			accept_conns(listen_fd);
+		g_free(fds);
+
+		settle();
+
+		// Respostas finais de quem fechou, e os aborts das suas transações
+		// liberam grants para as outras conexões.
+		for (int i = conns->len - 1; i >= 0; i--) {
+			struct server_conn *conn = g_ptr_array_index(conns, i);
+			if (conn->closed) {
+				flush_output(conn);
+				close_conn(conn);
+			}
+		}
+		settle();
+
+		for (int i = 0; i < conns->len; i++)
+			flush_output(g_ptr_array_index(conns, i));
+	}
+
+	while (conns->len > 0)
+		close_conn(g_ptr_array_index(conns, 0));
+
+	g_timer_stop(timer);
+	server_run.elapsed = g_timer_elapsed(timer, NULL);
+	server_run.committed = server_run.transactions - server_run.aborts;
+	g_timer_destroy(timer);
+
+	if (lock_manager_free())
+		fprintf(stderr, "ERROR!\n");
+
+	fprintf(stderr, "Served %d requests in %ld ticks (%ld reads, %ld writes)\n",
+			server_run.operations, ticks, reads, writes);
+
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		unlink(path);
+	}
+
+	g_hash_table_destroy(transaction_table);
+	g_ptr_array_free(conns, TRUE);
+	g_string_chunk_free(vars);
+
+	return 0;
+}
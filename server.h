@@ -0,0 +1,16 @@
+#ifndef _SERVER_
+#define _SERVER_
+
+#include <glib.h>
+
+#include "structs.h"
+
+// Tamanho de cada leitura de uma conexão; tudo que chega numa leitura é
+// tratado no mesmo passo do laço.
+#define SERVER_READ_SIZE 65536
+
+// Gerenciador de locks como serviço: escuta no socket Unix path, ou lê a
+// entrada padrão e responde na saída padrão se path for "-".
+int exec_server(char *path);
+
+#endif
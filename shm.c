@@ -0,0 +1,745 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <glib.h>
+
+#include "structs.h"
+#include "parser.h"
+#include "exec.h"
+#include "shm.h"
+
+// Tabela de locks num segmento de memória compartilhada POSIX. Cada
+// variável tem o seu latch (um mutex compartilhado entre processos) e uma
+// lista de pedidos, concedidos ou em espera, na ordem de chegada. Os
+// clientes pedem e liberam locks direto no segmento; um pedido que não pode
+// ser concedido dorme na variável de condição do seu slot até o grant ou
+// até o daemon escolhê-lo como vítima de um deadlock.
+//
+// Dentro do segmento só há índices, nunca ponteiros, para que processos que
+// mapeiem o segmento em endereços diferentes o enxerguem igual. Cabeçalho,
+// variáveis e slots ocupam linhas de cache próprias, para que latches de
+// variáveis vizinhas não disputem a mesma linha entre cores.
+
+#define SHM_MAGIC 0x2b1d0b7
+
+struct shm_header
+{
+	int magic;
+	int nvars;
+	int nslots;
+	int shutdown;
+	// Contadores do daemon.
+	int detections;
+	int deadlocks;
+	int start_seq;
+} __attribute__((aligned(64)));
+
+struct shm_var
+{
+	pthread_mutex_t latch;
+	int used;
+	char name[SHM_VAR_LEN];
+	// Primeiro pedido da lista, -1 se vazia.
+	int head;
+} __attribute__((aligned(64)));
+
+struct shm_slot
+{
+	pthread_cond_t cond;
+	int aborted;
+	// Pedido em espera e ordem em que a transação começou (para escolher a
+	// vítima).
+	int waiting;
+	int start_seq;
+	// Contadores do cliente dono do slot.
+	int operations;
+	int committed;
+	int aborts;
+	int waits;
+} __attribute__((aligned(64)));
+
+// Os pedidos de cada slot ficam num bloco fixo de SHM_MAX_LOCKS entradas,
+// alocadas só pelo dono, sem latch.
+struct shm_entry
+{
+	int slot;
+	int var;
+	enum command cmd;
+	int granted;
+	int next;
+};
+
+struct shm_table
+{
+	char *name;
+	size_t size;
+	struct shm_header *header;
+	struct shm_var *vars;
+	struct shm_slot *slots;
+	struct shm_entry *entries;
+};
+
+static size_t shm_size(int nvars, int nslots) {
+	return sizeof(struct shm_header) + nvars * sizeof(struct shm_var) +
+		nslots * sizeof(struct shm_slot) +
+		(size_t)nslots * SHM_MAX_LOCKS * sizeof(struct shm_entry);
+}
+
+static struct shm_table *shm_map(char *name, int fd, int nvars, int nslots) {
+	struct shm_table *table;
+	size_t size;
+	char *base;
+
+	size = shm_size(nvars, nslots);
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	table = g_new0(struct shm_table, 1);
+	table->name = g_strdup(name);
+	table->size = size;
+	table->header = (struct shm_header *)base;
+	table->vars = (struct shm_var *)(base + sizeof(struct shm_header));
+	table->slots = (struct shm_slot *)(table->vars + nvars);
+	table->entries = (struct shm_entry *)(table->slots + nslots);
+
+	return table;
+}
+
+struct shm_table *shm_table_create(char *name, int nvars, int nslots) {
+	struct shm_table *table;
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	int fd;
+
+	if ((name == NULL) || (nvars <= 0) || (nslots <= 0))
+		return NULL;
+
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0)
+		return NULL;
+
+	// O segmento novo vem zerado.
+	table = NULL;
+	if (ftruncate(fd, shm_size(nvars, nslots)) == 0)
+		table = shm_map(name, fd, nvars, nslots);
+	close(fd);
+	if (table == NULL) {
+		shm_unlink(name);
+		return NULL;
+	}
+
+	table->header->nvars = nvars;
+	table->header->nslots = nslots;
+
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+	for (int i = 0; i < nvars; i++) {
+		pthread_mutex_init(&table->vars[i].latch, &mattr);
+		table->vars[i].head = -1;
+	}
+	pthread_mutexattr_destroy(&mattr);
+
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+	for (int i = 0; i < nslots; i++) {
+		pthread_cond_init(&table->slots[i].cond, &cattr);
+		table->slots[i].waiting = -1;
+	}
+	pthread_condattr_destroy(&cattr);
+
+	// Só agora o segmento pode ser aberto por outros processos.
+	__sync_synchronize();
+	table->header->magic = SHM_MAGIC;
+
+	return table;
+}
+
+struct shm_table *shm_table_open(char *name) {
+	struct shm_table *table;
+	struct shm_header header;
+	int fd;
+
+	if (name == NULL)
+		return NULL;
+
+	fd = shm_open(name, O_RDWR, 0600);
+	if (fd < 0)
+		return NULL;
+
+	if ((pread(fd, &header, sizeof(header), 0) != sizeof(header)) ||
+			(header.magic != SHM_MAGIC)) {
+		close(fd);
+		return NULL;
+	}
+
+	table = shm_map(name, fd, header.nvars, header.nslots);
+	close(fd);
+
+	return table;
+}
+
+void shm_table_close(struct shm_table *table) {
+	if (table == NULL)
+		return;
+
+	munmap(table->header, table->size);
+	g_free(table->name);
+	g_free(table);
+}
+
+// Acha a variável por sondagem linear e devolve o índice com o latch já
+// pego. As entradas nunca são liberadas, então basta pegar um latch de
+// cada vez.
+static int find_var(struct shm_table *table, char *name, int create) {
+	struct shm_var *v;
+	int nvars = table->header->nvars;
+	int h;
+
+	if (strlen(name) >= SHM_VAR_LEN)
+		return -1;
+
+	h = g_str_hash(name) % nvars;
+	for (int i = 0; i < nvars; i++) {
+		int index = (h + i) % nvars;
+
+		v = &table->vars[index];
+		pthread_mutex_lock(&v->latch);
+		if (!v->used) {
+			if (!create) {
+				pthread_mutex_unlock(&v->latch);
+				return -1;
+			}
+			strcpy(v->name, name);
+			v->used = 1;
+			return index;
+		}
+		if (strcmp(v->name, name) == 0)
+			return index;
+		pthread_mutex_unlock(&v->latch);
+	}
+
+	return -1;
+}
+
+static int conflicts(struct shm_entry *a, struct shm_entry *b) {
+	if (a->slot == b->slot)
+		return 0;
+
+	return (a->cmd == CMD_LOCK_X) || (b->cmd == CMD_LOCK_X);
+}
+
+// Um pedido espera por quem já tem o lock e por quem chegou antes dele e
+// ainda espera, se os modos conflitam. Ao contrário do executor
+// centralizado, um pedido novo não passa na frente da fila: com processos de
+// verdade disputando, um pedido X ficaria para sempre atrás de um fluxo de S.
+static int waits_on(struct shm_entry *e, struct shm_entry *other, int ahead) {
+	return (other->granted || ahead) && conflicts(e, other);
+}
+
+// O pedido já tem de estar na lista da variável.
+static int can_grant(struct shm_table *table, struct shm_var *v, struct shm_entry *e) {
+	int ahead = 1;
+
+	for (int i = v->head; i >= 0; i = table->entries[i].next) {
+		struct shm_entry *other = &table->entries[i];
+		if (other == e)
+			ahead = 0;
+		else if (waits_on(e, other, ahead))
+			return 0;
+	}
+
+	return 1;
+}
+
+// Concede, na ordem da fila, os pedidos em espera que não conflitam com
+// ninguém à frente.
+static void grant_waiters(struct shm_table *table, struct shm_var *v) {
+	for (int i = v->head; i >= 0; i = table->entries[i].next) {
+		struct shm_entry *e = &table->entries[i];
+		if (e->granted || !can_grant(table, v, e))
+			continue;
+
+		e->granted = 1;
+		pthread_cond_signal(&table->slots[e->slot].cond);
+	}
+}
+
+static void unlink_entry(struct shm_table *table, struct shm_var *v, int index) {
+	int *link = &v->head;
+
+	while (*link >= 0) {
+		if (*link == index) {
+			*link = table->entries[index].next;
+			return;
+		}
+		link = &table->entries[*link].next;
+	}
+}
+
+// Remove os pedidos do slot na variável; o latch tem de estar pego.
+static void release_var(struct shm_table *table, int var, int slot) {
+	struct shm_var *v = &table->vars[var];
+	int *link = &v->head;
+
+	while (*link >= 0) {
+		if (table->entries[*link].slot == slot) {
+			table->entries[*link].granted = 0;
+			*link = table->entries[*link].next;
+		}
+		else
+			link = &table->entries[*link].next;
+	}
+
+	grant_waiters(table, v);
+}
+
+void shm_client_init(struct shm_client *client, struct shm_table *table, int slot) {
+	memset(client, 0, sizeof(struct shm_client));
+	client->table = table;
+	client->slot = slot;
+}
+
+void shm_begin(struct shm_client *client) {
+	struct shm_slot *s = &client->table->slots[client->slot];
+
+	client->unlocked = 0;
+	client->nlocks = 0;
+	// Vítima de deadlock recomeçando: mantém a idade.
+	if (!s->aborted)
+		s->start_seq = __sync_add_and_fetch(&client->table->header->start_seq, 1);
+	s->aborted = 0;
+	s->waiting = -1;
+}
+
+int shm_aborted(struct shm_client *client) {
+	return client->table->slots[client->slot].aborted;
+}
+
+enum op_stats shm_lock(struct shm_client *client, char *var, enum command cmd) {
+	struct shm_table *table = client->table;
+	struct shm_slot *s = &table->slots[client->slot];
+	struct shm_entry *e;
+	struct shm_var *v;
+	int index, held = 0;
+	int *link;
+
+	if (((cmd != CMD_LOCK_S) && (cmd != CMD_LOCK_X)) || client->unlocked ||
+			(client->nlocks >= SHM_MAX_LOCKS) || s->aborted)
+		return OP_ERROR;
+
+	index = find_var(table, var, 1);
+	if (index < 0)
+		return OP_ERROR;
+	v = &table->vars[index];
+	s->operations++;
+
+	// Um lock igual ou mais forte já concedido basta.
+	for (int i = v->head; i >= 0; i = table->entries[i].next) {
+		e = &table->entries[i];
+		if ((e->slot == client->slot) && e->granted &&
+				((e->cmd == CMD_LOCK_X) || (cmd == CMD_LOCK_S))) {
+			pthread_mutex_unlock(&v->latch);
+			return OP_OK;
+		}
+		if (e->slot == client->slot)
+			held = 1;
+	}
+
+	e = &table->entries[client->slot * SHM_MAX_LOCKS + client->nlocks];
+	e->slot = client->slot;
+	e->var = index;
+	e->cmd = cmd;
+	e->next = -1;
+	e->granted = 0;
+
+	for (link = &v->head; *link >= 0; link = &table->entries[*link].next)
+		;
+	*link = client->slot * SHM_MAX_LOCKS + client->nlocks;
+	e->granted = can_grant(table, v, e);
+	if (!held)
+		client->vars[client->nlocks] = index;
+	else
+		client->vars[client->nlocks] = -1;
+	client->nlocks++;
+
+	if (!e->granted) {
+		s->waiting = *link;
+		s->waits++;
+		while (!e->granted && !s->aborted)
+			pthread_cond_wait(&s->cond, &v->latch);
+		s->waiting = -1;
+	}
+
+	pthread_mutex_unlock(&v->latch);
+
+	return e->granted ? OP_OK : OP_ERROR;
+}
+
+// READ e WRITE só conferem os locks do próprio slot, que ninguém mais
+// altera enquanto a transação roda; não precisam de latch.
+enum op_stats shm_access(struct shm_client *client, char *var, enum command cmd) {
+	struct shm_table *table = client->table;
+	struct shm_entry *entries = &table->entries[client->slot * SHM_MAX_LOCKS];
+
+	table->slots[client->slot].operations++;
+	for (int i = 0; i < client->nlocks; i++) {
+		if (!entries[i].granted || strcmp(table->vars[entries[i].var].name, var))
+			continue;
+		if ((cmd == CMD_READ) || (entries[i].cmd == CMD_LOCK_X))
+			return OP_OK;
+	}
+
+	return OP_ERROR;
+}
+
+enum op_stats shm_unlock(struct shm_client *client, char *var) {
+	struct shm_table *table = client->table;
+	int index;
+
+	if (table->slots[client->slot].aborted)
+		return OP_ERROR;
+
+	index = find_var(table, var, 0);
+	if (index < 0)
+		return OP_ERROR;
+
+	table->slots[client->slot].operations++;
+	release_var(table, index, client->slot);
+	pthread_mutex_unlock(&table->vars[index].latch);
+	client->unlocked = 1;
+
+	return OP_OK;
+}
+
+// Fim da transação, por commit ou abort: libera o que sobrou.
+void shm_end(struct shm_client *client, int committed) {
+	struct shm_table *table = client->table;
+	struct shm_slot *s = &table->slots[client->slot];
+
+	for (int i = 0; i < client->nlocks; i++) {
+		int var = client->vars[i];
+		if (var < 0)
+			continue;
+
+		pthread_mutex_lock(&table->vars[var].latch);
+		release_var(table, var, client->slot);
+		pthread_mutex_unlock(&table->vars[var].latch);
+	}
+
+	client->nlocks = 0;
+	if (committed)
+		s->committed++;
+	else
+		s->aborts++;
+}
+
+// Busca em profundidade no grafo de espera (matriz de adjacência entre
+// slots). Devolve o slot onde um ciclo fecha, ou -1.
+static int find_cycle(char *edges, int nslots, int slot, char *color, int *parent) {
+	color[slot] = 1;
+	for (int i = 0; i < nslots; i++) {
+		if (!edges[slot * nslots + i])
+			continue;
+
+		if (color[i] == 1) {
+			parent[i] = slot;
+			return i;
+		}
+		if (color[i] == 0) {
+			parent[i] = slot;
+			int found = find_cycle(edges, nslots, i, color, parent);
+			if (found >= 0)
+				return found;
+		}
+	}
+	color[slot] = 2;
+
+	return -1;
+}
+
+// Vítima: o membro mais novo do ciclo. Quem recomeça guarda a idade, então
+// não volta a ser escolhido para sempre ao refazer o mesmo ciclo.
+static int pick_victim(struct shm_table *table, int start, int *parent) {
+	int victim = start;
+	int slot = start;
+
+	do {
+		slot = parent[slot];
+		if (table->slots[slot].start_seq > table->slots[victim].start_seq)
+			victim = slot;
+	} while (slot != start);
+
+	return victim;
+}
+
+static void abort_victim(struct shm_table *table, int victim) {
+	struct shm_slot *s = &table->slots[victim];
+	struct shm_entry *e = &table->entries[s->waiting];
+
+	unlink_entry(table, &table->vars[e->var], s->waiting);
+	s->waiting = -1;
+	s->aborted = 1;
+	pthread_cond_signal(&s->cond);
+}
+
+// Uma passada do daemon. Pega os latches de todas as variáveis em uso, em
+// ordem (os clientes nunca seguram mais de um, então não há deadlock entre
+// latches), monta o grafo de espera e aborta uma vítima por ciclo.
+int shm_detect(struct shm_table *table) {
+	struct shm_header *header = table->header;
+	int nslots = header->nslots;
+	int nvars = header->nvars;
+	int waiting = 0, victims = 0;
+	char *edges, *color, *latched;
+	int *parent;
+	int start;
+
+	for (int i = 0; i < nslots; i++)
+		waiting += (table->slots[i].waiting >= 0);
+	if (waiting < 2)
+		return 0;
+
+	// Uma variável pode entrar em uso durante a passada; guarda quais
+	// latches foram pegos para soltar exatamente esses.
+	header->detections++;
+	latched = g_new0(char, nvars);
+	for (int i = 0; i < nvars; i++) {
+		if (table->vars[i].used) {
+			pthread_mutex_lock(&table->vars[i].latch);
+			latched[i] = 1;
+		}
+	}
+
+	edges = g_new0(char, nslots * nslots);
+	color = g_new0(char, nslots);
+	parent = g_new0(int, nslots);
+
+	for (int i = 0; i < nslots; i++) {
+		struct shm_slot *s = &table->slots[i];
+		struct shm_entry *w;
+		int ahead;
+
+		if (s->waiting < 0)
+			continue;
+
+		w = &table->entries[s->waiting];
+		ahead = 1;
+		for (int j = table->vars[w->var].head; j >= 0; j = table->entries[j].next) {
+			struct shm_entry *e = &table->entries[j];
+			if (e == w)
+				ahead = 0;
+			else if (waits_on(w, e, ahead))
+				edges[i * nslots + e->slot] = 1;
+		}
+	}
+
+	for (int i = 0; i < nslots; i++) {
+		if (color[i] != 0)
+			continue;
+
+		start = find_cycle(edges, nslots, i, color, parent);
+		if (start < 0)
+			continue;
+
+		int victim = pick_victim(table, start, parent);
+		abort_victim(table, victim);
+		memset(&edges[victim * nslots], 0, nslots);
+		header->deadlocks++;
+		victims++;
+
+		// O grafo mudou; recomeça a busca do zero.
+		memset(color, 0, nslots);
+		i = -1;
+	}
+
+	g_free(edges);
+	g_free(color);
+	g_free(parent);
+
+	for (int i = nvars - 1; i >= 0; i--) {
+		if (latched[i])
+			pthread_mutex_unlock(&table->vars[i].latch);
+	}
+	g_free(latched);
+
+	return victims;
+}
+
+int shm_leftover(struct shm_table *table) {
+	for (int i = 0; i < table->header->nvars; i++) {
+		if (table->vars[i].used && (table->vars[i].head >= 0))
+			return 1;
+	}
+
+	return 0;
+}
+
+// Executa a transação uma vez. Devolve 1 no commit, 0 se foi vítima de um
+// deadlock (e pode tentar de novo) e -1 num erro.
+static int run_transaction(struct shm_client *client, GSList *ops) {
+	enum op_stats status = OP_OK;
+
+	shm_begin(client);
+	for (GSList *l = ops; (l != NULL) && (status == OP_OK); l = l->next) {
+		struct operation *op = l->data;
+
+		switch (op->cmd) {
+			case CMD_LOCK_S:
+			case CMD_LOCK_X:
+				status = shm_lock(client, op->var, op->cmd);
+				break;
+			case CMD_UNLOCK:
+				status = shm_unlock(client, op->var);
+				break;
+			case CMD_READ:
+			case CMD_WRITE:
+				status = shm_access(client, op->var, op->cmd);
+				break;
+			default:
+				status = OP_ERROR;
+				break;
+		}
+	}
+
+	shm_end(client, status == OP_OK);
+	if (status == OP_OK)
+		return 1;
+
+	return shm_aborted(client) ? 0 : -1;
+}
+
+static void client_main(struct shm_table *table, int slot, int nclients, GPtrArray *scripts) {
+	struct shm_client client;
+
+	shm_client_init(&client, table, slot);
+	for (int i = slot; i < scripts->len; i += nclients) {
+		while (run_transaction(&client, g_ptr_array_index(scripts, i)) == 0)
+			;
+	}
+}
+
+static void daemon_main(struct shm_table *table) {
+	while (!__sync_fetch_and_add(&table->header->shutdown, 0)) {
+		usleep(SHM_DETECT_INTERVAL);
+		shm_detect(table);
+	}
+}
+
+// Separa a escala em uma lista de operações por transação, na ordem em que
+// cada transação aparece.
+static GPtrArray *split_transactions(GSList *op_list, GHashTable *var_set) {
+	GHashTable *index;
+	GPtrArray *scripts;
+
+	index = g_hash_table_new(g_direct_hash, g_direct_equal);
+	scripts = g_ptr_array_new_with_free_func((GDestroyNotify)g_slist_free);
+
+	for (GSList *l = op_list; l != NULL; l = l->next) {
+		struct operation *op = l->data;
+		gpointer key = GINT_TO_POINTER(op->transaction);
+		int i;
+
+		if (!g_hash_table_contains(index, key)) {
+			g_hash_table_insert(index, key, GINT_TO_POINTER(scripts->len));
+			g_ptr_array_add(scripts, NULL);
+		}
+		i = GPOINTER_TO_INT(g_hash_table_lookup(index, key));
+		g_ptr_array_index(scripts, i) = g_slist_prepend(g_ptr_array_index(scripts, i), op);
+		g_hash_table_add(var_set, op->var);
+	}
+
+	for (int i = 0; i < scripts->len; i++)
+		g_ptr_array_index(scripts, i) = g_slist_reverse(g_ptr_array_index(scripts, i));
+
+	g_hash_table_destroy(index);
+
+	return scripts;
+}
+
+// Um processo cliente por slot, cada um com uma parte das transações, e um
+// daemon de detecção, todos sobre a mesma tabela. Vítimas de deadlock
+// recomeçam a transação.
+void exec_operations_shm(GSList *op_list, int nclients, struct exec_stats *run) {
+	struct shm_table *table;
+	GHashTable *var_set;
+	GPtrArray *scripts;
+	GTimer *timer;
+	pid_t daemon, *clients;
+	char *name;
+
+	if ((op_list == NULL) || (run == NULL) || (nclients <= 0))
+		return;
+
+	memset(run, 0, sizeof(struct exec_stats));
+	var_set = g_hash_table_new(g_str_hash, g_str_equal);
+	scripts = split_transactions(op_list, var_set);
+
+	name = g_strdup_printf("/implDB_t2.%d", getpid());
+	table = shm_table_create(name, 2 * g_hash_table_size(var_set) + 1, nclients);
+	g_hash_table_destroy(var_set);
+	if (table == NULL) {
+		printf("Could not create the shared lock table.\n");
+		g_ptr_array_free(scripts, TRUE);
+		g_free(name);
+		return;
+	}
+
+	fflush(stdout);
+	timer = g_timer_new();
+	daemon = fork();
+	if (daemon == 0) {
+		daemon_main(table);
+		_exit(0);
+	}
+
+	clients = g_new0(pid_t, nclients);
+	for (int i = 0; i < nclients; i++) {
+		clients[i] = fork();
+		if (clients[i] == 0) {
+			client_main(table, i, nclients, scripts);
+			_exit(0);
+		}
+	}
+
+	// Todos já mapearam o segmento; o nome não é mais necessário e assim
+	// nada sobra em /dev/shm se a execução for interrompida.
+	shm_unlink(name);
+
+	for (int i = 0; i < nclients; i++)
+		waitpid(clients[i], NULL, 0);
+	g_timer_stop(timer);
+
+	__sync_fetch_and_add(&table->header->shutdown, 1);
+	waitpid(daemon, NULL, 0);
+
+	run->elapsed = g_timer_elapsed(timer, NULL);
+	run->transactions = scripts->len;
+	run->deadlocks = table->header->deadlocks;
+	run->detections = table->header->detections;
+	for (int i = 0; i < nclients; i++) {
+		run->operations += table->slots[i].operations;
+		run->committed += table->slots[i].committed;
+		run->aborts += table->slots[i].aborts;
+		run->waits += table->slots[i].waits;
+	}
+
+	if (shm_leftover(table))
+		printf("ERROR!\n");
+
+	printf("SHM:\n");
+	printf("\tclients: %d\n", nclients);
+	printf("\tvariables: %d\n", table->header->nvars);
+
+	shm_table_close(table);
+	g_free(name);
+	g_free(clients);
+	g_timer_destroy(timer);
+	g_ptr_array_free(scripts, TRUE);
+}
@@ -0,0 +1,46 @@
+#ifndef _SHM_
+#define _SHM_
+
+#include <glib.h>
+
+#include "structs.h"
+#include "exec.h"
+
+// Locks que uma transação pode pedir entre shm_begin e shm_end.
+#define SHM_MAX_LOCKS 64
+#define SHM_VAR_LEN 32
+// Intervalo entre as passadas do daemon de detecção, em microssegundos.
+#define SHM_DETECT_INTERVAL 1000
+
+struct shm_table;
+
+// Lado do cliente: cada processo usa um slot de transação próprio e pede
+// locks direto na tabela compartilhada, sem falar com o daemon.
+struct shm_client
+{
+	struct shm_table *table;
+	int slot;
+	int unlocked;
+	int nlocks;
+	int vars[SHM_MAX_LOCKS];
+};
+
+struct shm_table *shm_table_create(char *name, int nvars, int nslots);
+struct shm_table *shm_table_open(char *name);
+void shm_table_close(struct shm_table *table);
+
+void shm_client_init(struct shm_client *client, struct shm_table *table, int slot);
+void shm_begin(struct shm_client *client);
+enum op_stats shm_lock(struct shm_client *client, char *var, enum command cmd);
+enum op_stats shm_access(struct shm_client *client, char *var, enum command cmd);
+enum op_stats shm_unlock(struct shm_client *client, char *var);
+void shm_end(struct shm_client *client, int committed);
+int shm_aborted(struct shm_client *client);
+
+// Lado do daemon: uma passada de detecção sobre o grafo de espera inteiro.
+int shm_detect(struct shm_table *table);
+int shm_leftover(struct shm_table *table);
+
+void exec_operations_shm(GSList *op_list, int nclients, struct exec_stats *run);
+
+#endif
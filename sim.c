@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "structs.h"
+#include "exec.h"
+#include "gen.h"
+#include "sim.h"
+
+// Simulador em laço fechado. Nas escalas estáticas uma transação bloqueada
+// continua "emitindo" as linhas seguintes; aqui cada cliente só pede a
+// próxima operação depois que a anterior foi concedida, e pensa um pouco
+// entre uma resposta e o próximo pedido. Há sempre mpl clientes: quando uma
+// transação termina, o mesmo cliente começa outra. Medindo a vazão para
+// cada mpl aparece o joelho em que mais clientes só produzem mais espera e
+// mais deadlocks (thrashing de locks).
+//
+// Cada cliente é uma corrotina sem pilha: o estado fica em struct
+// sim_client e client_step() continua de onde parou a cada passo.
+
+enum client_state
+{
+	CLIENT_THINKING = 0,
+	CLIENT_READY,
+	CLIENT_WAITING
+};
+
+struct sim_client
+{
+	enum client_state state;
+	int think;
+	// Tentativa atual da transação e a operação que ela vai pedir.
+	int transaction;
+	GSList *ops;
+	GSList *next;
+	int started;
+};
+
+// Resultado de um nível de multiprogramação.
+struct sim_level
+{
+	int mpl;
+	int commits;
+	int aborts;
+	int deadlocks;
+	int waits;
+	long response;
+	long blocked;
+};
+
+static struct gen_params *gen;
+static struct sim_params *params;
+static GRand *sim_rand;
+static GHashTable *client_table;
+// As tabelas do gerenciador de locks usam as strings das operações como
+// chave, então as operações das transações terminadas só são liberadas no
+// fim do nível.
+static GSList *finished;
+static struct sim_level *level;
+static int tick;
+static int next_id;
+
+int parse_sim_params(char *spec, struct sim_params *sim) {
+	int values[3] = { 16, 0, 10000 };
+	char **fields;
+	int n;
+
+	if (sim == NULL)
+		return -1;
+
+	if (spec != NULL) {
+		fields = g_strsplit(spec, ",", 3);
+		n = g_strv_length(fields);
+		for (int i = 0; i < n; i++) {
+			if (strlen(fields[i]) > 0)
+				values[i] = atoi(fields[i]);
+		}
+		g_strfreev(fields);
+	}
+
+	sim->mpl = values[0];
+	sim->think = values[1];
+	sim->ticks = values[2];
+
+	if ((sim->mpl <= 0) || (sim->think < 0) || (sim->ticks <= 0))
+		return -1;
+
+	return 0;
+}
+
+// Tempo de pensar uniforme em [0, 2 * think], com média think.
+static void start_thinking(struct sim_client *c) {
+	c->state = CLIENT_THINKING;
+	c->think = params->think ? g_rand_int_range(sim_rand, 0, 2 * params->think + 1) : 0;
+}
+
+static void set_transaction(struct sim_client *c, int id) {
+	c->transaction = id;
+	for (GSList *l = c->ops; l != NULL; l = l->next)
+		((struct operation *)l->data)->transaction = id;
+	g_hash_table_insert(client_table, GINT_TO_POINTER(id), c);
+}
+
+static void begin_transaction(struct sim_client *c) {
+	int id = next_id++;
+
+	c->ops = generate_transaction(id, gen, sim_rand);
+	c->next = c->ops;
+	c->started = tick;
+	set_transaction(c, id);
+}
+
+static void free_operation(gpointer data) {
+	struct operation *op = data;
+
+	g_free(op->var);
+	g_free(op->low);
+	g_free(op->high);
+	g_free(op);
+}
+
+static void end_transaction(struct sim_client *c) {
+	g_hash_table_remove(client_table, GINT_TO_POINTER(c->transaction));
+	finished = g_slist_concat(c->ops, finished);
+	c->ops = NULL;
+	c->next = NULL;
+}
+
+// A vítima (ou a transação com erro) solta os locks e recomeça do zero, com
+// outro id, depois de pensar; o tempo de resposta conta desde a primeira
+// tentativa.
+static void abort_client(struct sim_client *c) {
+	level->aborts++;
+	lock_manager_abort(c->transaction);
+	g_hash_table_remove(client_table, GINT_TO_POINTER(c->transaction));
+	set_transaction(c, next_id++);
+	c->next = c->ops;
+	start_thinking(c);
+}
+
+// A operação pedida foi concedida, na hora ou por um grant.
+static void complete_operation(struct sim_client *c) {
+	c->next = c->next->next;
+	if (c->next == NULL) {
+		level->commits++;
+		level->response += tick - c->started;
+		end_transaction(c);
+	}
+	start_thinking(c);
+}
+
+static void client_step(struct sim_client *c) {
+	struct operation *op;
+	enum op_stats stats;
+
+	switch (c->state) {
+		case CLIENT_THINKING:
+			if (c->think > 0) {
+				c->think--;
+				return;
+			}
+			if (c->ops == NULL)
+				begin_transaction(c);
+			c->state = CLIENT_READY;
+			// fall through
+		case CLIENT_READY:
+			op = c->next->data;
+			stats = lock_manager_request(op);
+			if (stats == OP_OK)
+				complete_operation(c);
+			else if (stats == OP_WAIT) {
+				c->state = CLIENT_WAITING;
+				level->waits++;
+			}
+			else
+				abort_client(c);
+			return;
+		case CLIENT_WAITING:
+			return;
+	}
+}
+
+// Entrega os grants e resolve os deadlocks novos; cada abort pode liberar
+// mais grants.
+static void settle() {
+	struct sim_client *c;
+	int id, progress;
+
+	do {
+		progress = 0;
+		while (lock_manager_next_grant(&id)) {
+			c = g_hash_table_lookup(client_table, GINT_TO_POINTER(id));
+			complete_operation(c);
+		}
+
+		while (lock_manager_next_suspect(&id)) {
+			if (lock_manager_in_cycle(id)) {
+				level->deadlocks++;
+				abort_client(g_hash_table_lookup(client_table, GINT_TO_POINTER(id)));
+				progress = 1;
+			}
+		}
+	} while (progress);
+}
+
+static void run_level(int mpl, struct sim_level *result) {
+	struct sim_client *clients;
+	struct exec_stats run;
+
+	memset(result, 0, sizeof(struct sim_level));
+	result->mpl = mpl;
+	level = result;
+	sim_rand = g_rand_new_with_seed(gen->seed);
+	client_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+	next_id = 1;
+	lock_manager_init(&run);
+
+	clients = g_new0(struct sim_client, mpl);
+	for (int i = 0; i < mpl; i++)
+		start_thinking(&clients[i]);
+
+	for (tick = 1; tick <= params->ticks; tick++) {
+		for (int i = 0; i < mpl; i++)
+			client_step(&clients[i]);
+		settle();
+
+		for (int i = 0; i < mpl; i++)
+			result->blocked += clients[i].state == CLIENT_WAITING;
+	}
+
+	// Transações ainda em andamento no fim da medição não contam.
+	for (int i = 0; i < mpl; i++) {
+		if (clients[i].ops != NULL) {
+			lock_manager_abort(clients[i].transaction);
+			end_transaction(&clients[i]);
+		}
+	}
+
+	if (lock_manager_free())
+		printf("ERROR!\n");
+
+	g_slist_free_full(finished, free_operation);
+	finished = NULL;
+	g_free(clients);
+	g_hash_table_destroy(client_table);
+	g_rand_free(sim_rand);
+}
+
+// Roda mpl = 1, 2, 4... até sim->mpl, sempre com a mesma semente, e mostra
+// a vazão de cada nível.
+void exec_closed_loop(struct gen_params *gen_params, struct sim_params *sim) {
+	struct sim_level result;
+	double throughput, peak = -1;
+	int peak_mpl = 0;
+
+	gen = gen_params;
+	params = sim;
+
+	printf("%6s %9s %9s %9s %9s %12s %9s %8s\n", "MPL", "commits", "aborts",
+			"deadlocks", "waits", "commits/1k", "response", "blocked");
+	for (int mpl = 1; ; mpl = MIN(2 * mpl, sim->mpl)) {
+		run_level(mpl, &result);
+
+		throughput = 1000.0 * result.commits / sim->ticks;
+		if (throughput > peak) {
+			peak = throughput;
+			peak_mpl = mpl;
+		}
+
+		printf("%6d %9d %9d %9d %9d %12.2f %9.1f %7.1f%%\n", mpl, result.commits,
+				result.aborts, result.deadlocks, result.waits, throughput,
+				result.commits ? (double)result.response / result.commits : 0.0,
+				100.0 * result.blocked / ((double)mpl * sim->ticks));
+
+		if (mpl == sim->mpl)
+			break;
+	}
+
+	printf("Peak throughput: %.2f commits per 1000 ticks at MPL %d\n", peak, peak_mpl);
+}
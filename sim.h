@@ -0,0 +1,22 @@
+#ifndef _SIM_
+#define _SIM_
+
+#include <glib.h>
+
+#include "structs.h"
+#include "gen.h"
+
+// Parâmetros do simulador em laço fechado: até mpl clientes simultâneos,
+// think passos em média entre uma resposta e o próximo pedido e ticks
+// passos simulados em cada nível de multiprogramação.
+struct sim_params
+{
+	int mpl;
+	int think;
+	int ticks;
+};
+
+int parse_sim_params(char *spec, struct sim_params *sim);
+void exec_closed_loop(struct gen_params *params, struct sim_params *sim);
+
+#endif
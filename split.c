@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "structs.h"
+#include "exec.h"
+#include "interval.h"
+#include "split.h"
+
+// Replay paralelo por componentes. Transações que nunca tocam as mesmas
+// variáveis (nem intervalos sobrepostos) não interagem no 2PL: nenhuma
+// espera pela outra, e um ciclo de espera nunca passa pelas duas. Uma
+// pré-passada junta, com union-find, cada transação às variáveis que ela
+// usa; cada componente conexo é reexecutado numa thread com o seu próprio
+// gerenciador de locks, e os relatórios são somados. Dentro de um componente
+// os eventos acontecem na mesma ordem da execução sequencial, então grants,
+// deadlocks e vítimas são os mesmos.
+
+// Um grupo de componentes reexecutado de uma vez por uma thread.
+struct job
+{
+	GSList *ops;
+	struct exec_stats run;
+	// Saída do grupo, impressa na ordem dos grupos no fim.
+	char *text;
+	size_t length;
+};
+
+// Variável ou intervalo distinto da escala, para a varredura de
+// sobreposições.
+struct key
+{
+	int node;
+	char *low;
+	char *high;
+};
+
+static struct job *jobs;
+static int njobs;
+static int next_job;
+
+// Quantos grupos cada thread recebe, para equilibrar a carga sem pagar a
+// criação do gerenciador de locks por componente.
+#define JOBS_PER_THREAD 4
+
+static int find(int *parent, int node) {
+	while (parent[node] != node) {
+		parent[node] = parent[parent[node]];
+		node = parent[node];
+	}
+
+	return node;
+}
+
+static void join(int *parent, int a, int b) {
+	a = find(parent, a);
+	b = find(parent, b);
+	if (a != b)
+		parent[MAX(a, b)] = MIN(a, b);
+}
+
+static int node_of(GHashTable *nodes, gpointer key, int *count) {
+	gpointer value;
+
+	if (g_hash_table_lookup_extended(nodes, key, NULL, &value))
+		return GPOINTER_TO_INT(value);
+
+	g_hash_table_insert(nodes, key, GINT_TO_POINTER(*count));
+	return (*count)++;
+}
+
+static int key_cmp(gconstpointer a, gconstpointer b) {
+	return strcmp(((struct key *)a)->low, ((struct key *)b)->low);
+}
+
+// Índices de componentes, do maior para o menor.
+static int size_cmp(gconstpointer a, gconstpointer b, gpointer sizes) {
+	int ia = *(int *)a, ib = *(int *)b;
+	int sa = ((int *)sizes)[ia], sb = ((int *)sizes)[ib];
+
+	if (sa != sb)
+		return sb - sa;
+
+	return ia - ib;
+}
+
+static char *op_low(struct operation *op) {
+	return op->low ? op->low : op->var;
+}
+
+// Com intervalos, chaves diferentes também podem conflitar. Em ordem de
+// início, uma chave se sobrepõe ao grupo corrente se começa antes do maior
+// fim visto nele.
+static void join_overlaps(GArray *keys, int *parent) {
+	struct key *max = NULL;
+
+	g_array_sort(keys, key_cmp);
+	for (int i = 0; i < keys->len; i++) {
+		struct key *k = &g_array_index(keys, struct key, i);
+
+		if ((max != NULL) && interval_overlaps(k->low, k->high, max->low, max->high)) {
+			join(parent, k->node, max->node);
+			if (interval_end_cmp(k->low, k->high, max->low, max->high) > 0)
+				max = k;
+		}
+		else
+			max = k;
+	}
+}
+
+// Distribui componentes de tamanhos sizes em nbins caixas, o maior primeiro
+// na caixa mais vazia. Retorna a caixa de cada componente.
+static int *pack_components(int *sizes, int ncomponents, int nbins) {
+	int *order, *bin, *load;
+
+	order = g_new(int, ncomponents);
+	bin = g_new(int, ncomponents);
+	load = g_new0(int, nbins);
+	for (int i = 0; i < ncomponents; i++)
+		order[i] = i;
+	g_qsort_with_data(order, ncomponents, sizeof(int), size_cmp, sizes);
+
+	for (int i = 0; i < ncomponents; i++) {
+		int lightest = 0;
+		for (int b = 1; b < nbins; b++) {
+			if (load[b] < load[lightest])
+				lightest = b;
+		}
+		bin[order[i]] = lightest;
+		load[lightest] += sizes[order[i]];
+	}
+
+	g_free(order);
+	g_free(load);
+
+	return bin;
+}
+
+// Nó de uma transação: ids pequenos (o caso das escalas geradas e dos
+// arquivos) vão direto num vetor, os demais na tabela.
+static int transaction_node(GHashTable *transactions, int *dense, int m, int id, int *count) {
+	if ((id >= 0) && (id < m)) {
+		if (dense[id] < 0)
+			dense[id] = (*count)++;
+		return dense[id];
+	}
+
+	return node_of(transactions, GINT_TO_POINTER(id), count);
+}
+
+// Reparte a escala em no máximo njobs listas de operações independentes entre
+// si, de tamanhos parecidos. Cada lista junta componentes inteiros e mantém a
+// ordem original das operações; as listas saem na ordem da primeira operação.
+// Retorna NULL quando tudo cabe num grupo só: não há o que repartir e a
+// escala pode ser executada como está.
+GSList *split_components(GSList *op_list, int njobs, int *ncomponents) {
+	GHashTable *transactions, *vars;
+	GSList **lists, *jobs = NULL;
+	GArray *keys;
+	char **last_var;
+	int *parent, *op_node, *dense, *component, *sizes, *bin, *job;
+	int ntransactions = 0, nvars = 0, ranges = 0, ncomp = 0, i;
+	int m = g_slist_length(op_list);
+
+	// Transações são os nós [0, m) e variáveis os nós [m, 2m).
+	transactions = g_hash_table_new(g_direct_hash, g_direct_equal);
+	vars = g_hash_table_new(g_str_hash, g_str_equal);
+	keys = g_array_new(FALSE, FALSE, sizeof(struct key));
+	parent = g_new(int, 2 * m);
+	op_node = g_new(int, m);
+	dense = g_new(int, m);
+	last_var = g_new0(char *, m);
+	for (i = 0; i < 2 * m; i++)
+		parent[i] = i;
+	for (i = 0; i < m; i++)
+		dense[i] = -1;
+
+	i = 0;
+	for (GSList *l = op_list; l != NULL; l = l->next, i++) {
+		struct operation *op = l->data;
+		int t, v, before;
+
+		t = op_node[i] = transaction_node(transactions, dense, m, op->transaction, &ntransactions);
+		// O LOCK e o acesso seguinte repetem a variável: a união já foi
+		// feita e a tabela nem é consultada.
+		if ((last_var[t] != NULL) && (strcmp(last_var[t], op->var) == 0))
+			continue;
+		last_var[t] = op->var;
+
+		before = nvars;
+		v = m + node_of(vars, op->var, &nvars);
+		if (nvars != before) {
+			struct key k = { v, op_low(op), op->high };
+			g_array_append_val(keys, k);
+			ranges |= (op->high != NULL);
+		}
+		join(parent, t, v);
+	}
+
+	if (ranges)
+		join_overlaps(keys, parent);
+
+	// Numera os componentes pela raiz de cada transação.
+	component = g_new(int, MAX(ntransactions, 1));
+	sizes = g_new0(int, MAX(ntransactions, 1));
+	for (i = 0; i < ntransactions; i++)
+		component[i] = -1;
+	for (i = 0; i < m; i++) {
+		int root = find(parent, op_node[i]);
+		if (component[root] < 0)
+			component[root] = ncomp++;
+		op_node[i] = component[root];
+		sizes[op_node[i]]++;
+	}
+
+	if (ncomponents != NULL)
+		*ncomponents = ncomp;
+
+	njobs = MAX(MIN(njobs, ncomp), 1);
+	if (njobs > 1) {
+		bin = pack_components(sizes, ncomp, njobs);
+
+		// As caixas viram listas na ordem em que aparecem na escala.
+		job = g_new(int, njobs);
+		lists = g_new0(GSList *, njobs);
+		for (i = 0; i < njobs; i++)
+			job[i] = -1;
+		njobs = 0;
+		i = 0;
+		for (GSList *l = op_list; l != NULL; l = l->next, i++) {
+			int b = bin[op_node[i]];
+			if (job[b] < 0)
+				job[b] = njobs++;
+			lists[job[b]] = g_slist_prepend(lists[job[b]], l->data);
+		}
+		for (i = njobs - 1; i >= 0; i--)
+			jobs = g_slist_prepend(jobs, g_slist_reverse(lists[i]));
+
+		g_free(bin);
+		g_free(job);
+		g_free(lists);
+	}
+
+	g_hash_table_destroy(transactions);
+	g_hash_table_destroy(vars);
+	g_array_free(keys, TRUE);
+	g_free(parent);
+	g_free(op_node);
+	g_free(dense);
+	g_free(last_var);
+	g_free(component);
+	g_free(sizes);
+
+	return jobs;
+}
+
+static gpointer replay_worker(gpointer data) {
+	struct job *job;
+	FILE *file;
+	int i;
+
+	while ((i = g_atomic_int_add(&next_job, 1)) < njobs) {
+		job = &jobs[i];
+		file = open_memstream(&job->text, &job->length);
+		exec_set_output(file);
+		exec_operations(job->ops, &job->run);
+		exec_set_output(NULL);
+		fclose(file);
+	}
+
+	return NULL;
+}
+
+static void merge_stats(struct exec_stats *run, struct exec_stats *part) {
+	run->operations += part->operations;
+	run->transactions += part->transactions;
+	run->committed += part->committed;
+	run->waits += part->waits;
+	run->upgrade_waits += part->upgrade_waits;
+	run->deadlocks += part->deadlocks;
+	run->aborts += part->aborts;
+	run->detections += part->detections;
+	run->detect_time += part->detect_time;
+	run->deadlock_delay += part->deadlock_delay;
+	run->locks_s_left += part->locks_s_left;
+	run->locks_u_left += part->locks_u_left;
+	run->locks_x_left += part->locks_x_left;
+	run->waits_left += part->waits_left;
+}
+
+void exec_operations_parallel(GSList *op_list, int nthreads, struct exec_stats *run) {
+	GSList *lists;
+	GThread **threads;
+	GTimer *timer;
+	int ncomponents, i;
+
+	if ((op_list == NULL) || (run == NULL))
+		return;
+
+	// Com uma thread só, repartir não ganha nada: nem a pré-passada.
+	if (nthreads == 1) {
+		printf("Replaying on 1 thread, without splitting the schedule\n");
+		exec_operations(op_list, run);
+		return;
+	}
+
+	memset(run, 0, sizeof(struct exec_stats));
+	timer = g_timer_new();
+
+	lists = split_components(op_list, nthreads * JOBS_PER_THREAD, &ncomponents);
+
+	// Um componente só (ou todos num grupo): a escala roda como está, sem
+	// cópia da lista, memstream nem threads.
+	if (lists == NULL) {
+		printf("%d independent components, replaying on 1 thread\n", ncomponents);
+		exec_operations(op_list, run);
+		run->elapsed = g_timer_elapsed(timer, NULL);
+		g_timer_destroy(timer);
+		return;
+	}
+
+	njobs = g_slist_length(lists);
+	nthreads = MIN(nthreads, njobs);
+	printf("%d independent components, replaying on %d threads\n", ncomponents, nthreads);
+
+	jobs = g_new0(struct job, njobs);
+	i = 0;
+	for (GSList *l = lists; l != NULL; l = l->next, i++)
+		jobs[i].ops = l->data;
+
+	// Os grupos já saem equilibrados; cada thread pega o próximo livre.
+	next_job = 0;
+	threads = g_new(GThread *, nthreads);
+	for (i = 0; i < nthreads; i++)
+		threads[i] = g_thread_new("replay", replay_worker, NULL);
+	for (i = 0; i < nthreads; i++)
+		g_thread_join(threads[i]);
+
+	g_timer_stop(timer);
+	for (i = 0; i < njobs; i++) {
+		fwrite(jobs[i].text, 1, jobs[i].length, stdout);
+		merge_stats(run, &jobs[i].run);
+		free(jobs[i].text);
+		g_slist_free(jobs[i].ops);
+	}
+	run->elapsed = g_timer_elapsed(timer, NULL);
+
+	g_timer_destroy(timer);
+	g_slist_free(lists);
+	g_free(threads);
+	g_free(jobs);
+}
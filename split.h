@@ -0,0 +1,11 @@
+#ifndef _SPLIT_
+#define _SPLIT_
+
+#include <glib.h>
+
+#include "structs.h"
+
+GSList *split_components(GSList *op_list, int njobs, int *ncomponents);
+void exec_operations_parallel(GSList *op_list, int nthreads, struct exec_stats *run);
+
+#endif
@@ -10,6 +10,8 @@ enum command
 	CMD_LOCK_S,
 	CMD_LOCK_X,
 	CMD_UNLOCK,
+	// Lock de atualização: convive com S, mas não com outro U nem com X.
+	CMD_LOCK_U,
 	CMD_UNKNOWN
 };
 
@@ -18,6 +20,54 @@ struct operation
 	int transaction;
 	enum command cmd;
 	char *var;
+	// Limites de um intervalo [low, high) como "[A,M)"; NULL para uma
+	// variável só.
+	char *low;
+	char *high;
+	// Posição na escala, numerada pelo executor 2PL para os checkpoints.
+	int seq;
+};
+
+// Relatório de uma execução, comum a todos os executores.
+struct exec_stats
+{
+	int operations;
+	int transactions;
+	int committed;
+	int waits;
+	// Esperas de quem já tinha um lock na variável e pediu um mais forte.
+	int upgrade_waits;
+	int deadlocks;
+	int aborts;
+	double elapsed;
+	// Custo da detecção de deadlocks contra o atraso em resolvê-los.
+	int detections;
+	double detect_time;
+	long deadlock_delay;
+	// Estado final das tabelas: locks S, U e X ainda concedidos e pedidos
+	// ainda na fila quando a escala acabou.
+	int locks_s_left;
+	int locks_u_left;
+	int locks_x_left;
+	int waits_left;
+};
+
+// Quando rodar a detecção de deadlocks: a cada interval passos, quando
+// blocked transações estiverem bloqueadas ou quando um pedido esperar waited
+// passos. Tudo zero: a cada aresta de espera nova.
+struct detect_policy
+{
+	int interval;
+	int blocked;
+	int waited;
+};
+
+// Checkpoints do executor 2PL: o estado vai para path a cada every
+// operações da escala (0 desliga) e sempre que checkpoint_requested ligar.
+struct checkpoint_policy
+{
+	char *path;
+	int every;
 };
 
 
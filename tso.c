@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "structs.h"
+#include "parser.h"
+#include "exec.h"
+
+// Executor por ordenação de timestamps (TO básico). Não usa locks, fila de
+// espera nem detector de deadlocks: operações atrasadas abortam e reiniciam
+// a transação com um timestamp novo. O abort desfaz as marcas da tentativa,
+// e a transação reiniciada volta a pedir as suas operações, uma por passo,
+// intercaladas com as que chegam da escala.
+
+enum ts_stats
+{
+	TS_OK = 0,
+	TS_SKIP,
+	TS_ABORT
+};
+
+struct ts_var
+{
+	int read_ts;
+	int write_ts;
+	// Timestamps das tentativas que leram e escreveram a variável, do maior
+	// para o menor. Um abort tira os da tentativa, e as marcas voltam ao
+	// maior que sobrou.
+	GSList *reads;
+	GSList *writes;
+};
+
+struct ts_transaction
+{
+	int id;
+	int ts;
+	int aborts;
+	// Operações da tentativa corrente, da mais nova para a mais velha.
+	GSList *history;
+	// Operações a reexecutar depois de um abort e as que chegaram da escala
+	// enquanto isso, na ordem.
+	GQueue pending;
+	int ready;
+};
+
+static GHashTable *ts_var_table;
+static GHashTable *ts_transaction_table;
+// Transações reiniciadas com operações em pending.
+static GQueue *ts_ready_queue;
+static int ts_clock;
+
+// Insere ts em marks, em ordem decrescente e sem repetir.
+static GSList *mark_add(GSList *marks, int ts) {
+	GSList *l, *prev = NULL;
+
+	for (l = marks; (l != NULL) && (GPOINTER_TO_INT(l->data) > ts); l = l->next)
+		prev = l;
+
+	if ((l != NULL) && (GPOINTER_TO_INT(l->data) == ts))
+		return marks;
+
+	if (prev == NULL)
+		return g_slist_prepend(marks, GINT_TO_POINTER(ts));
+
+	prev->next = g_slist_prepend(l, GINT_TO_POINTER(ts));
+	return marks;
+}
+
+static int mark_max(GSList *marks) {
+	return marks ? GPOINTER_TO_INT(marks->data) : 0;
+}
+
+static void free_var(gpointer data) {
+	struct ts_var *v = data;
+
+	g_slist_free(v->reads);
+	g_slist_free(v->writes);
+	g_free(v);
+}
+
+static struct ts_var *get_var(char *var) {
+	struct ts_var *v;
+
+	v = g_hash_table_lookup(ts_var_table, var);
+	if (v == NULL) {
+		v = g_new0(struct ts_var, 1);
+		g_hash_table_insert(ts_var_table, var, v);
+	}
+
+	return v;
+}
+
+static struct ts_transaction *get_transaction(int id) {
+	struct ts_transaction *t;
+
+	t = g_hash_table_lookup(ts_transaction_table, GINT_TO_POINTER(id));
+	if (t == NULL) {
+		t = g_new0(struct ts_transaction, 1);
+		t->id = id;
+		g_hash_table_insert(ts_transaction_table, GINT_TO_POINTER(id), t);
+	}
+
+	// O timestamp é atribuído na primeira operação da transação.
+	if (t->ts == 0)
+		t->ts = ++ts_clock;
+
+	return t;
+}
+
+static enum ts_stats ts_operation_status(struct ts_transaction *t, struct operation *op, int thomas) {
+	struct ts_var *v;
+
+	switch (op->cmd) {
+		case CMD_READ:
+			v = get_var(op->var);
+			if (t->ts < v->write_ts)
+				return TS_ABORT;
+			v->reads = mark_add(v->reads, t->ts);
+			v->read_ts = mark_max(v->reads);
+			return TS_OK;
+		case CMD_WRITE:
+			v = get_var(op->var);
+			if (t->ts < v->read_ts)
+				return TS_ABORT;
+			if (t->ts < v->write_ts) {
+				// Regra de escrita de Thomas: a escrita já está obsoleta.
+				if (thomas)
+					return TS_SKIP;
+				return TS_ABORT;
+			}
+			v->writes = mark_add(v->writes, t->ts);
+			v->write_ts = mark_max(v->writes);
+			return TS_OK;
+		case CMD_LOCK_S:
+		case CMD_LOCK_X:
+		case CMD_LOCK_U:
+		case CMD_UNLOCK:
+			// Locks não têm efeito na ordenação por timestamps.
+			return TS_OK;
+		case CMD_UNKNOWN:
+		default:
+			break;
+	}
+
+	return TS_ABORT;
+}
+
+// Tira as marcas da tentativa corrente de t das variáveis que ela tocou.
+static void undo_marks(struct ts_transaction *t) {
+	for (GSList *l = t->history; l != NULL; l = l->next) {
+		struct operation *op = l->data;
+		struct ts_var *v;
+
+		if ((op->cmd != CMD_READ) && (op->cmd != CMD_WRITE))
+			continue;
+
+		v = get_var(op->var);
+		if (op->cmd == CMD_READ) {
+			v->reads = g_slist_remove(v->reads, GINT_TO_POINTER(t->ts));
+			v->read_ts = mark_max(v->reads);
+		}
+		else {
+			v->writes = g_slist_remove(v->writes, GINT_TO_POINTER(t->ts));
+			v->write_ts = mark_max(v->writes);
+		}
+	}
+}
+
+// Aborta a tentativa de t, atrasada em op, e a reinicia com um timestamp
+// maior que todos os existentes. O que ela já tinha feito e op voltam para a
+// frente de pending, e a transação entra na fila de prontas.
+static void restart_transaction(struct ts_transaction *t, struct operation *op,
+		struct exec_stats *run) {
+	printf("* ABORTING TRANSACTION: %d *\n", t->id);
+	run->aborts++;
+	t->aborts++;
+	undo_marks(t);
+	t->ts = ++ts_clock;
+	printf("* RESTARTING TRANSACTION: %d (TS %d) *\n", t->id, t->ts);
+
+	g_queue_push_head(&t->pending, op);
+	for (GSList *l = t->history; l != NULL; l = l->next)
+		g_queue_push_head(&t->pending, l->data);
+	g_slist_free(t->history);
+	t->history = NULL;
+
+	if (!t->ready) {
+		t->ready = 1;
+		g_queue_push_tail(ts_ready_queue, t);
+	}
+}
+
+static void exec_ts_operation(struct ts_transaction *t, struct operation *op,
+		int thomas, struct exec_stats *run) {
+	enum ts_stats stats;
+
+	run->operations++;
+	stats = ts_operation_status(t, op, thomas);
+	if (stats == TS_ABORT) {
+		if (verbose) {
+			printf("LATE: ");
+			dump_operation(op);
+		}
+		restart_transaction(t, op, run);
+		return;
+	}
+
+	if ((stats == TS_SKIP) && verbose) {
+		printf("SKIP: ");
+		dump_operation(op);
+	}
+	t->history = g_slist_prepend(t->history, op);
+}
+
+// Próxima operação da primeira transação pronta. Ela fica na frente da fila
+// até acabar o que tem a reexecutar, ou vai para o fim se abortar de novo.
+// Só ela reexecuta: reiniciadas que se revezassem poderiam atrasar umas às
+// outras para sempre, e assim, quando a escala acaba, a da frente só aborta
+// de novo por marcas de quem nem reexecutou ainda.
+static void exec_ready_transaction(int thomas, struct exec_stats *run) {
+	struct ts_transaction *t = g_queue_pop_head(ts_ready_queue);
+	struct operation *op = g_queue_pop_head(&t->pending);
+
+	t->ready = 0;
+	if (verbose) {
+		printf("REDO: ");
+		dump_operation(op);
+	}
+	exec_ts_operation(t, op, thomas, run);
+
+	if (!t->ready && !g_queue_is_empty(&t->pending)) {
+		t->ready = 1;
+		g_queue_push_head(ts_ready_queue, t);
+	}
+}
+
+static void free_transaction(gpointer data) {
+	struct ts_transaction *t = data;
+
+	g_slist_free(t->history);
+	g_queue_clear(&t->pending);
+	g_free(t);
+}
+
+void exec_operations_ts(GSList *op_list, int thomas, struct exec_stats *run) {
+	struct ts_transaction *t;
+	struct operation *op;
+	GTimer *timer;
+	int schedule_turn = 1;
+
+	if ((op_list == NULL) || (run == NULL))
+		return;
+
+	memset(run, 0, sizeof(struct exec_stats));
+	ts_clock = 0;
+	ts_var_table = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_var);
+	ts_transaction_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, free_transaction);
+	ts_ready_queue = g_queue_new();
+	timer = g_timer_new();
+
+	// Cada passo executa uma operação: alternadamente a próxima de uma
+	// transação reiniciada e a próxima da escala, enquanto houver as duas.
+	for (GSList *l = op_list; (l != NULL) || !g_queue_is_empty(ts_ready_queue);) {
+		if (!g_queue_is_empty(ts_ready_queue) && ((l == NULL) || !schedule_turn)) {
+			exec_ready_transaction(thomas, run);
+			schedule_turn = 1;
+			continue;
+		}
+
+		op = l->data;
+		l = l->next;
+		schedule_turn = 0;
+		t = get_transaction(op->transaction);
+		if (verbose) {
+			printf("EXEC: ");
+			dump_operation(op);
+		}
+
+		// Atrás do que a transação ainda tem a reexecutar.
+		if (!g_queue_is_empty(&t->pending)) {
+			g_queue_push_tail(&t->pending, op);
+			continue;
+		}
+
+		exec_ts_operation(t, op, thomas, run);
+	}
+
+	g_timer_stop(timer);
+	run->elapsed = g_timer_elapsed(timer, NULL);
+	// Toda transação reiniciada acaba sendo efetivada.
+	run->transactions = g_hash_table_size(ts_transaction_table);
+	run->committed = run->transactions;
+	g_timer_destroy(timer);
+
+	g_queue_free(ts_ready_queue);
+	g_hash_table_destroy(ts_var_table);
+	g_hash_table_destroy(ts_transaction_table);
+}
@@ -0,0 +1,10 @@
+#ifndef _TSO_
+#define _TSO_
+
+#include <glib.h>
+
+#include "structs.h"
+
+void exec_operations_ts(GSList *op_list, int thomas, struct exec_stats *run);
+
+#endif